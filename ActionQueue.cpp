@@ -0,0 +1,96 @@
+/*
+* ActionQueue.cpp
+*
+* Project: ESPixelStick - An ESP8266 and E1.31 based pixel driver
+* Copyright (c) 2016 Shelby Merrick
+* http://www.forkineye.com
+*
+*  This program is provided free for you to use in any way that you wish,
+*  subject to the laws and regulations where you are using it.  Due diligence
+*  is strongly suggested before using this code.  Please give credit where due.
+*
+*  The Author makes no warranty of any kind, express or implied, with regard
+*  to this program or the documentation contained in this document.  The
+*  Author shall not be liable in any event for incidental or consequential
+*  damages in connection with, or arising out of, the furnishing, performance
+*  or use of these programs.
+*
+*/
+
+#include "ActionQueue.h"
+
+/* Longest the timer is armed for, os_timer can't go much past an hour
+   and the clock may be corrected in the meantime */
+#define MAX_ARM_MS  60000
+
+void ActionQueue::begin(action_fn_t action, clock_fn_t clock) {
+    _action = action;
+    _clock = clock;
+}
+
+bool ActionQueue::add(uint64_t at, uint8_t action, uint32_t arg) {
+    if (_count >= MAX_ACTIONS)
+        return false;
+
+    // Insert sorted, after any action due at the same time
+    uint8_t i = _count;
+    while (i && _queue[i - 1].at > at) {
+        _queue[i] = _queue[i - 1];
+        i--;
+    }
+    _queue[i] = { at, arg, action };
+    _count++;
+
+    if (!i)
+        arm();
+    return true;
+}
+
+void ActionQueue::clear() {
+    _timer.detach();
+    _count = 0;
+}
+
+void ActionQueue::fire(ActionQueue *queue) {
+    queue->run();
+}
+
+/* Run everything that's due, then wait for the next one */
+void ActionQueue::run() {
+    uint64_t now;
+    if (!_clock(now))
+        return;
+
+    uint8_t due = 0;
+    while (due < _count && _queue[due].at <= now) {
+        uint32_t late = now - _queue[due].at;
+        if (late > _maxLate)
+            _maxLate = late;
+        _action(_queue[due].action, _queue[due].arg);
+        _run++;
+        due++;
+    }
+
+    if (due) {
+        _count -= due;
+        memmove(_queue, _queue + due, _count * sizeof(action_t));
+    }
+    arm();
+}
+
+void ActionQueue::arm() {
+    _timer.detach();
+
+    uint64_t now;
+    if (!_count || !_clock(now))
+        return;
+
+    if (_queue[0].at <= now) {
+        // Already due, but not from inside add() or a request
+        _timer.once_ms(0, fire, this);
+        return;
+    }
+
+    uint64_t wait = _queue[0].at - now;
+    _timer.once_ms(wait > MAX_ARM_MS ? MAX_ARM_MS : (uint32_t)wait, fire, this);
+}
@@ -0,0 +1,76 @@
+/*
+* ActionQueue.h
+*
+* Project: ESPixelStick - An ESP8266 and E1.31 based pixel driver
+* Copyright (c) 2016 Shelby Merrick
+* http://www.forkineye.com
+*
+*  This program is provided free for you to use in any way that you wish,
+*  subject to the laws and regulations where you are using it.  Due diligence
+*  is strongly suggested before using this code.  Please give credit where due.
+*
+*  The Author makes no warranty of any kind, express or implied, with regard
+*  to this program or the documentation contained in this document.  The
+*  Author shall not be liable in any event for incidental or consequential
+*  damages in connection with, or arising out of, the furnishing, performance
+*  or use of these programs.
+*
+*/
+
+#ifndef ACTIONQUEUE_H_
+#define ACTIONQUEUE_H_
+
+#include <Arduino.h>
+#include <Ticker.h>
+
+/* Actions to run at a given wall clock time, in ms since the epoch.  The
+   queue is kept sorted and a single timer is armed for the earliest
+   action, so actions don't wait for a scheduler pass.  The timer runs in
+   the SDK's system context though, which only gets in when the loop
+   yields: an action is late by whatever the loop is in the middle of,
+   about a millisecond on an idle loop.  getMaxLate() reports the worst
+   seen.  The callback runs in the timer's context; keep it short.
+   Requests, timers and the loop don't preempt each other on the ESP8266,
+   so there are no locks.  Call rearm() whenever the clock is stepped. */
+class ActionQueue {
+ public:
+    static const uint8_t MAX_ACTIONS = 32;
+
+    /* Returns false for an action it doesn't know */
+    typedef bool (*action_fn_t)(uint8_t action, uint32_t arg);
+    typedef bool (*clock_fn_t)(uint64_t &ms);
+
+    void begin(action_fn_t action, clock_fn_t clock);
+
+    /* Queue an action, false if full */
+    bool add(uint64_t at, uint8_t action, uint32_t arg = 0);
+    void clear();
+
+    /* The clock was stepped, work out the next action again */
+    void rearm() { arm(); }
+
+    uint8_t count() { return _count; }
+    uint32_t getRun() { return _run; }
+    uint32_t getMaxLate() { return _maxLate; }     /* ms */
+
+ private:
+    typedef struct {
+        uint64_t    at;
+        uint32_t    arg;
+        uint8_t     action;
+    } action_t;
+
+    static void fire(ActionQueue *queue);
+    void run();
+    void arm();
+
+    action_fn_t     _action = nullptr;
+    clock_fn_t      _clock = nullptr;
+    Ticker          _timer;
+    action_t        _queue[MAX_ACTIONS];
+    uint8_t         _count = 0;
+    uint32_t        _run = 0;
+    uint32_t        _maxLate = 0;
+};
+
+#endif /* ACTIONQUEUE_H_ */
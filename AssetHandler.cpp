@@ -0,0 +1,115 @@
+/*
+* AssetHandler.cpp
+*
+* Project: ESPixelStick - An ESP8266 and E1.31 based pixel driver
+* Copyright (c) 2016 Shelby Merrick
+* http://www.forkineye.com
+*
+*  This program is provided free for you to use in any way that you wish,
+*  subject to the laws and regulations where you are using it.  Due diligence
+*  is strongly suggested before using this code.  Please give credit where due.
+*
+*  The Author makes no warranty of any kind, express or implied, with regard
+*  to this program or the documentation contained in this document.  The
+*  Author shall not be liable in any event for incidental or consequential
+*  damages in connection with, or arising out of, the furnishing, performance
+*  or use of these programs.
+*
+*/
+
+#include <Arduino.h>
+#include <FS.h>
+#include <ArduinoJson.h>
+#include "AssetHandler.h"
+
+#define ASSET_MANIFEST      "manifest.json"
+#define ASSET_DEFAULT       "index.html"
+#define ASSET_IMMUTABLE     "public, max-age=31536000, immutable"
+#define ASSET_REVALIDATE    "no-cache"
+
+bool AssetHandler::begin(FS &fs, const char *root) {
+    _fs = &fs;
+    _root = root;
+    _count = 0;
+
+    File file = fs.open(_root + ASSET_MANIFEST, "r");
+    if (!file)
+        return false;
+
+    DynamicJsonDocument json(1024);
+    if (deserializeJson(json, file))
+        return false;
+
+    // Existence of the .gz variant is settled once here, not per request
+    for (JsonPair kv : json.as<JsonObject>()) {
+        if (_count == MAX_ASSETS)
+            break;
+        asset_t &asset = _assets[_count++];
+        asset.name = kv.key().c_str();
+        asset.etag = "\"" + kv.value().as<String>() + "\"";
+        asset.gzip = fs.exists(_root + asset.name + ".gz");
+    }
+
+    return true;
+}
+
+const AssetHandler::asset_t * AssetHandler::find(const String &url) {
+    String name = (url == "/") ? String(ASSET_DEFAULT) : url.substring(1);
+    for (uint8_t i = 0; i < _count; i++) {
+        if (_assets[i].name == name)
+            return &_assets[i];
+    }
+    return nullptr;
+}
+
+bool AssetHandler::canHandle(AsyncWebServerRequest *request) {
+    return request->method() == HTTP_GET && find(request->url());
+}
+
+void AssetHandler::handleRequest(AsyncWebServerRequest *request) {
+    const asset_t *asset = find(request->url());
+    if (!asset) {
+        request->send(404);
+        return;
+    }
+
+    // Versioned URLs can only ever have this content
+    const char *cacheControl = ASSET_REVALIDATE;
+    if (request->hasParam("v") &&
+            asset->etag == "\"" + request->getParam("v")->value() + "\"")
+        cacheControl = ASSET_IMMUTABLE;
+
+    AsyncWebServerResponse *response;
+    if (request->hasHeader("If-None-Match") &&
+            request->header("If-None-Match") == asset->etag) {
+        response = request->beginResponse(304);
+    } else {
+        String path = _root + asset->name;
+        if (asset->gzip)
+            path += ".gz";
+        response = request->beginResponse(*_fs, path, contentType(asset->name));
+        if (asset->gzip)
+            response->addHeader("Content-Encoding", "gzip");
+    }
+
+    response->addHeader("ETag", asset->etag);
+    response->addHeader("Cache-Control", cacheControl);
+    request->send(response);
+}
+
+const char * AssetHandler::contentType(const String &name) {
+    if (name.endsWith(".html") || name.endsWith(".htm"))
+        return "text/html";
+    else if (name.endsWith(".css"))
+        return "text/css";
+    else if (name.endsWith(".js"))
+        return "application/javascript";
+    else if (name.endsWith(".json"))
+        return "application/json";
+    else if (name.endsWith(".png"))
+        return "image/png";
+    else if (name.endsWith(".ico"))
+        return "image/x-icon";
+    else
+        return "text/plain";
+}
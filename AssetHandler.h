@@ -0,0 +1,57 @@
+/*
+* AssetHandler.h
+*
+* Project: ESPixelStick - An ESP8266 and E1.31 based pixel driver
+* Copyright (c) 2016 Shelby Merrick
+* http://www.forkineye.com
+*
+*  This program is provided free for you to use in any way that you wish,
+*  subject to the laws and regulations where you are using it.  Due diligence
+*  is strongly suggested before using this code.  Please give credit where due.
+*
+*  The Author makes no warranty of any kind, express or implied, with regard
+*  to this program or the documentation contained in this document.  The
+*  Author shall not be liable in any event for incidental or consequential
+*  damages in connection with, or arising out of, the furnishing, performance
+*  or use of these programs.
+*
+*/
+
+#ifndef ASSETHANDLER_H_
+#define ASSETHANDLER_H_
+
+#include <ESPAsyncWebServer.h>
+
+/* Serves the web assets listed in the manifest.json gulp writes to
+   data/www.  Each response carries the content hash as a strong ETag, so a
+   matching If-None-Match is answered with 304 without touching the file.
+   Requests made with ?v=<hash> (as gulp rewrites index.html to do) are
+   marked immutable; everything else must revalidate. */
+class AssetHandler : public AsyncWebHandler {
+ public:
+    static const uint8_t MAX_ASSETS = 16;
+
+    /* Load the manifest from root (e.g. "/www/").  Returns false if there
+       isn't one, in which case nothing is handled. */
+    bool begin(FS &fs, const char *root);
+
+    bool canHandle(AsyncWebServerRequest *request) override;
+    void handleRequest(AsyncWebServerRequest *request) override;
+
+ private:
+    typedef struct {
+        String  name;       /* Request path, less the leading '/' */
+        String  etag;       /* Quoted content hash */
+        bool    gzip;       /* Stored as name.gz */
+    } asset_t;
+
+    const asset_t * find(const String &url);
+    static const char * contentType(const String &name);
+
+    FS      *_fs = nullptr;
+    String  _root;
+    asset_t _assets[MAX_ASSETS];
+    uint8_t _count = 0;
+};
+
+#endif /* ASSETHANDLER_H_ */
@@ -0,0 +1,169 @@
+/*
+* CommandChannel.cpp
+*
+* Project: ESPixelStick - An ESP8266 and E1.31 based pixel driver
+* Copyright (c) 2016 Shelby Merrick
+* http://www.forkineye.com
+*
+*  This program is provided free for you to use in any way that you wish,
+*  subject to the laws and regulations where you are using it.  Due diligence
+*  is strongly suggested before using this code.  Please give credit where due.
+*
+*  The Author makes no warranty of any kind, express or implied, with regard
+*  to this program or the documentation contained in this document.  The
+*  Author shall not be liable in any event for incidental or consequential
+*  damages in connection with, or arising out of, the furnishing, performance
+*  or use of these programs.
+*
+*/
+
+#include "CommandChannel.h"
+
+void CommandChannel::setKey(const uint8_t *key, size_t len) {
+    br_hmac_key_init(&_key, &br_sha256_vtable, key, len);
+}
+
+bool CommandChannel::begin(uint16_t port, IPAddress multicast,
+        command_fn_t command, clock_fn_t clock) {
+    _command = command;
+    _clock = clock;
+
+    // A multicast listener takes unicast to the port too, and a second
+    // socket on the same port would fail to bind
+    if (multicast.isSet() ? !_udp.listenMulticast(multicast, port) : !_udp.listen(port))
+        return false;
+    _udp.onPacket([this](AsyncUDPPacket &packet) { receive(packet); });
+
+    _started = true;
+    return true;
+}
+
+void CommandChannel::write(Print &out) {
+    out.print(F("# TYPE udp_commands_received_total counter\n"));
+    out.printf_P(PSTR("udp_commands_received_total %u\n"), _received);
+    out.print(F("# TYPE udp_commands_accepted_total counter\n"));
+    out.printf_P(PSTR("udp_commands_accepted_total %u\n"), _accepted);
+    out.print(F("# TYPE udp_commands_rejected_total counter\n"));
+    out.printf_P(PSTR("udp_commands_rejected_total{reason=\"mac\"} %u\n"), _badMac);
+    out.printf_P(PSTR("udp_commands_rejected_total{reason=\"replay\"} %u\n"), _replayed);
+    out.printf_P(PSTR("udp_commands_rejected_total{reason=\"stale\"} %u\n"), _stale);
+    out.printf_P(PSTR("udp_commands_rejected_total{reason=\"unsynced\"} %u\n"), _unsynced);
+    out.print(F("# TYPE udp_command_max_seconds gauge\n"));
+    out.printf_P(PSTR("udp_command_max_seconds %u.%06u\n"),
+            _maxRunMicros / 1000000, _maxRunMicros % 1000000);
+}
+
+void CommandChannel::receive(AsyncUDPPacket &udp) {
+    uint32_t start = micros();
+    _received++;
+
+    if (udp.length() != sizeof(packet_t))
+        return;
+    packet_t packet;
+    memcpy(&packet, udp.data(), sizeof(packet));
+    if (packet.magic[0] != 'R' || packet.magic[1] != 'C' ||
+            packet.version != VERSION || packet.command >= STATUS_OK)
+        return;
+
+    if (!verify(packet)) {
+        _badMac++;
+        return;
+    }
+
+    // Addressed to another group, not ours to ack
+    if (packet.group && packet.group != _group)
+        return;
+
+    uint64_t now;
+    if (!_clock || !_clock(now)) {
+        _unsynced++;
+        packet.command = STATUS_UNSYNCED;
+    } else {
+        int32_t skew = (int32_t)(packet.time - (uint32_t)(now / 1000));
+        if (skew > (int32_t)MAX_SKEW || skew < -(int32_t)MAX_SKEW) {
+            _stale++;
+            packet.command = STATUS_STALE;
+        }
+    }
+
+    if (packet.command < STATUS_OK) {
+        if (replayed(packet.sender, packet.seq)) {
+            _replayed++;
+            packet.command = STATUS_REPLAY;
+        } else if (_command(packet.command, packet.arg)) {
+            _accepted++;
+            packet.command = STATUS_OK;
+        } else {
+            packet.command = STATUS_UNKNOWN;
+        }
+    }
+
+    uint32_t elapsed = micros() - start;
+    if (elapsed > _maxRunMicros)
+        _maxRunMicros = elapsed;
+
+    // Ack, with the sequence number and arg echoed
+    sign(packet);
+    udp.write(reinterpret_cast<uint8_t *>(&packet), sizeof(packet));
+}
+
+void CommandChannel::sign(packet_t &packet) {
+    br_hmac_context ctx;
+    br_hmac_init(&ctx, &_key, MAC_LEN);
+    br_hmac_update(&ctx, &packet, offsetof(packet_t, mac));
+    br_hmac_out(&ctx, packet.mac);
+}
+
+bool CommandChannel::verify(const packet_t &packet) {
+    uint8_t mac[MAC_LEN];
+    br_hmac_context ctx;
+    br_hmac_init(&ctx, &_key, MAC_LEN);
+    br_hmac_update(&ctx, &packet, offsetof(packet_t, mac));
+    br_hmac_out(&ctx, mac);
+
+    // Constant time
+    uint8_t diff = 0;
+    for (uint8_t i = 0; i < MAC_LEN; i++)
+        diff |= mac[i] ^ packet.mac[i];
+    return !diff;
+}
+
+/* Sliding window check, marks seq as seen */
+bool CommandChannel::replayed(uint16_t id, uint32_t seq) {
+    sender_t *sender = nullptr;
+    sender_t *oldest = &_senders[0];
+    for (uint8_t i = 0; i < MAX_SENDERS; i++) {
+        if (_senders[i].used && _senders[i].sender == id) {
+            sender = &_senders[i];
+            break;
+        }
+        if (oldest->used && (!_senders[i].used ||
+                (int32_t)(_senders[i].lastUsed - oldest->lastUsed) < 0))
+            oldest = &_senders[i];
+    }
+
+    // New sender, evicting the least recently heard from if we're full
+    if (!sender) {
+        sender = oldest;
+        sender->sender = id;
+        sender->used = true;
+        sender->top = seq;
+        sender->window = 1;
+        sender->lastUsed = millis();
+        return false;
+    }
+
+    sender->lastUsed = millis();
+    if (seq > sender->top) {
+        uint32_t shift = seq - sender->top;
+        sender->window = shift >= WINDOW ? 1 : (sender->window << shift) | 1;
+        sender->top = seq;
+        return false;
+    }
+
+    uint32_t offset = sender->top - seq;
+    if (offset >= WINDOW || (sender->window & (1UL << offset)))
+        return true;
+    sender->window |= 1UL << offset;
+    return false;
+}
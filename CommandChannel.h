@@ -0,0 +1,112 @@
+/*
+* CommandChannel.h
+*
+* Project: ESPixelStick - An ESP8266 and E1.31 based pixel driver
+* Copyright (c) 2016 Shelby Merrick
+* http://www.forkineye.com
+*
+*  This program is provided free for you to use in any way that you wish,
+*  subject to the laws and regulations where you are using it.  Due diligence
+*  is strongly suggested before using this code.  Please give credit where due.
+*
+*  The Author makes no warranty of any kind, express or implied, with regard
+*  to this program or the documentation contained in this document.  The
+*  Author shall not be liable in any event for incidental or consequential
+*  damages in connection with, or arising out of, the furnishing, performance
+*  or use of these programs.
+*
+*/
+
+#ifndef COMMANDCHANNEL_H_
+#define COMMANDCHANNEL_H_
+
+#include <ESPAsyncUDP.h>
+#include <bearssl/bearssl.h>
+
+/* Authenticated command datagrams, unicast or to a multicast group.  Each
+   packet carries an HMAC-SHA256 (truncated) over its header under a shared
+   key.  Replays are caught with a per-sender sliding window of sequence
+   numbers, and by rejecting packets more than MAX_SKEW seconds off the
+   clock, which also covers the window being lost on a reboot or a sender
+   being evicted from it.  Without the clock the window alone can't stop
+   replays, so commands are refused until it's synced, which means never
+   in SoftAP mode.  Commands run straight from the UDP callback; keep the
+   handler short.  Valid packets are acked to the sender with the same sequence
+   number, so a sender can measure round trip times.  Packets that fail the
+   MAC are dropped without a reply. */
+class CommandChannel {
+ public:
+    static const uint8_t VERSION = 1;
+    static const uint8_t MAC_LEN = 12;
+    static const uint8_t MAX_SENDERS = 8;
+    static const uint8_t WINDOW = 32;       /* Sequence numbers */
+    static const uint32_t MAX_SKEW = 30;    /* s */
+
+    /* Ack status, in the command field of the reply */
+    enum Status : uint8_t {
+        STATUS_OK = 0x80,
+        STATUS_REPLAY,
+        STATUS_STALE,
+        STATUS_UNKNOWN,     /* Not a command the handler takes */
+        STATUS_UNSYNCED     /* Clock not synced yet, try again later */
+    };
+
+    typedef struct __attribute__((packed)) {
+        uint8_t     magic[2];   /* 'R' 'C' */
+        uint8_t     version;
+        uint8_t     command;
+        uint16_t    sender;     /* Replay state is kept per sender */
+        uint8_t     group;      /* 0 for every device */
+        uint8_t     flags;
+        uint32_t    seq;
+        uint32_t    time;       /* Epoch s */
+        uint32_t    arg;
+        uint8_t     mac[MAC_LEN];
+    } packet_t;
+
+    /* Returns false for a command it doesn't know */
+    typedef bool (*command_fn_t)(uint8_t command, uint32_t arg);
+    typedef bool (*clock_fn_t)(uint64_t &ms);
+
+    void setKey(const uint8_t *key, size_t len);
+    void setGroup(uint8_t group) { _group = group; }
+
+    /* Listen on port, joining the multicast group if it's set */
+    bool begin(uint16_t port, IPAddress multicast, command_fn_t command,
+            clock_fn_t clock);
+    bool isStarted() { return _started; }
+
+    /* Prometheus counters */
+    void write(Print &out);
+
+ private:
+    typedef struct {
+        uint16_t    sender;
+        bool        used;
+        uint32_t    top;        /* Highest seq accepted */
+        uint32_t    window;     /* Bit n set if top - n was accepted */
+        uint32_t    lastUsed;   /* millis(), to pick one to evict */
+    } sender_t;
+
+    void receive(AsyncUDPPacket &packet);
+    void sign(packet_t &packet);
+    bool verify(const packet_t &packet);
+    bool replayed(uint16_t sender, uint32_t seq);
+
+    AsyncUDP                _udp;
+    br_hmac_key_context     _key;
+    bool                    _started = false;
+    uint8_t                 _group = 0;
+    command_fn_t            _command = nullptr;
+    clock_fn_t              _clock = nullptr;
+    sender_t                _senders[MAX_SENDERS] = {};
+    uint32_t                _received = 0;
+    uint32_t                _accepted = 0;
+    uint32_t                _badMac = 0;
+    uint32_t                _replayed = 0;
+    uint32_t                _stale = 0;
+    uint32_t                _unsynced = 0;
+    uint32_t                _maxRunMicros = 0;
+};
+
+#endif /* COMMANDCHANNEL_H_ */
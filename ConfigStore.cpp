@@ -0,0 +1,168 @@
+/*
+* ConfigStore.cpp
+*
+* Project: ESPixelStick - An ESP8266 and E1.31 based pixel driver
+* Copyright (c) 2016 Shelby Merrick
+* http://www.forkineye.com
+*
+*  This program is provided free for you to use in any way that you wish,
+*  subject to the laws and regulations where you are using it.  Due diligence
+*  is strongly suggested before using this code.  Please give credit where due.
+*
+*  The Author makes no warranty of any kind, express or implied, with regard
+*  to this program or the documentation contained in this document.  The
+*  Author shall not be liable in any event for incidental or consequential
+*  damages in connection with, or arising out of, the furnishing, performance
+*  or use of these programs.
+*
+*/
+
+#include <Arduino.h>
+#include "ConfigStore.h"
+
+ConfigStore::ConfigStore(FS &fs, const char *fileA, const char *fileB,
+        size_t logSize) : _fs(&fs), _logSize(logSize) {
+    _files[0] = fileA;
+    _files[1] = fileB;
+}
+
+uint32_t ConfigStore::crc32(uint32_t crc, const uint8_t *data, size_t len) {
+    crc = ~crc;
+    while (len--) {
+        crc ^= *data++;
+        for (uint8_t i = 0; i < 8; i++)
+            crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
+    return ~crc;
+}
+
+/* Walk the records in one file, stopping at the first that doesn't check
+   out.  Records are appended in order, so the last valid one is newest. */
+ConfigStore::scan_t ConfigStore::scan(const char *name) {
+    scan_t result = {};
+    File file = _fs->open(name, "r");
+    if (!file)
+        return result;
+
+    uint32_t pos = 0;
+    record_t record;
+    uint8_t buf[64];
+    while (file.read(reinterpret_cast<uint8_t *>(&record), sizeof(record))
+            == sizeof(record)) {
+        if (record.magic != MAGIC)
+            break;
+
+        uint32_t crc = crc32(0, reinterpret_cast<uint8_t *>(&record),
+                offsetof(record_t, crc));
+        size_t left = record.size;
+        while (left) {
+            size_t chunk = file.read(buf, left < sizeof(buf) ? left : sizeof(buf));
+            if (!chunk)
+                break;
+            crc = crc32(crc, buf, chunk);
+            left -= chunk;
+        }
+        if (left || crc != record.crc)
+            break;
+
+        result.seq = record.seq;
+        result.pos = pos;
+        result.crc = record.crc;
+        result.valid = true;
+        pos += sizeof(record) + record.size;
+        result.end = pos;
+    }
+
+    return result;
+}
+
+/* Pick the file holding the newest record */
+void ConfigStore::select() {
+    scan_t a = scan(_files[0]);
+    scan_t b = scan(_files[1]);
+
+    if (b.valid && (!a.valid || (int32_t)(b.seq - a.seq) > 0)) {
+        _active = 1;
+        _newest = b;
+    } else {
+        _active = 0;
+        _newest = a;
+    }
+}
+
+bool ConfigStore::load(uint8_t *data, size_t size, uint16_t &version, size_t &len) {
+    select();
+    if (!_newest.valid)
+        return false;
+
+    File file = _fs->open(_files[_active], "r");
+    if (!file || !file.seek(_newest.pos, SeekSet))
+        return false;
+
+    record_t record;
+    if (file.read(reinterpret_cast<uint8_t *>(&record), sizeof(record)) != sizeof(record)
+            || record.size > size
+            || file.read(data, record.size) != record.size)
+        return false;
+
+    version = record.version;
+    len = record.size;
+    return true;
+}
+
+bool ConfigStore::save(uint16_t version, const uint8_t *data, size_t len) {
+    if (len > 0xFFFF)
+        return false;
+    /* Rescan, the file system may have been replaced since the last call */
+    select();
+
+    record_t record = {};
+    record.magic = MAGIC;
+    record.version = version;
+    record.seq = _newest.valid ? _newest.seq + 1 : 0;
+    record.size = len;
+
+    /* Compare against the newest record with its sequence number */
+    record.crc = crc32(0, reinterpret_cast<uint8_t *>(&record), offsetof(record_t, crc));
+    record.crc = crc32(record.crc, data, len);
+    if (_newest.valid) {
+        record_t last = record;
+        last.seq = _newest.seq;
+        uint32_t crc = crc32(0, reinterpret_cast<uint8_t *>(&last), offsetof(record_t, crc));
+        if (crc32(crc, data, len) == _newest.crc)
+            return true;
+    }
+
+    /* Append, unless the active file is full or has a torn tail */
+    uint8_t target = _active;
+    File file = _fs->open(_files[_active], "r");
+    size_t fileSize = file ? file.size() : 0;
+    file.close();
+    bool rotate = fileSize != (_newest.valid ? _newest.end : 0)
+            || fileSize + sizeof(record) + len > _logSize;
+    if (rotate)
+        target = !_active;
+
+    file = _fs->open(_files[target], rotate ? "w" : "a");
+    if (!file)
+        return false;
+
+    uint32_t pos = rotate ? 0 : fileSize;
+    bool ok = file.write(reinterpret_cast<uint8_t *>(&record), sizeof(record)) == sizeof(record)
+            && file.write(data, len) == len;
+    file.close();
+    if (!ok)
+        return false;
+
+    /* The new record is durable, retire the old file */
+    if (rotate)
+        _fs->remove(_files[_active]);
+
+    _active = target;
+    _newest.seq = record.seq;
+    _newest.pos = pos;
+    _newest.end = pos + sizeof(record) + len;
+    _newest.crc = record.crc;
+    _newest.valid = true;
+    return true;
+}
@@ -0,0 +1,73 @@
+/*
+* ConfigStore.h
+*
+* Project: ESPixelStick - An ESP8266 and E1.31 based pixel driver
+* Copyright (c) 2016 Shelby Merrick
+* http://www.forkineye.com
+*
+*  This program is provided free for you to use in any way that you wish,
+*  subject to the laws and regulations where you are using it.  Due diligence
+*  is strongly suggested before using this code.  Please give credit where due.
+*
+*  The Author makes no warranty of any kind, express or implied, with regard
+*  to this program or the documentation contained in this document.  The
+*  Author shall not be liable in any event for incidental or consequential
+*  damages in connection with, or arising out of, the furnishing, performance
+*  or use of these programs.
+*
+*/
+
+#ifndef CONFIGSTORE_H_
+#define CONFIGSTORE_H_
+
+#include <FS.h>
+
+/* Append-only log of versioned, CRC checked records spread over two files.
+   A save appends one record to the active file; the newest record that
+   checks out wins on load, so a torn write just falls back to the previous
+   one.  Once the active file would grow past logSize (or has a torn tail)
+   the record is written to the other file, which is only then committed by
+   removing the old one. */
+class ConfigStore {
+ public:
+    static const uint16_t MAGIC = 0x4643;   // 'C', 'F'
+
+    ConfigStore(FS &fs, const char *fileA, const char *fileB, size_t logSize);
+
+    /* Read the newest valid record into data.  Returns false if there is
+       none or it doesn't fit, otherwise its schema version and length. */
+    bool load(uint8_t *data, size_t size, uint16_t &version, size_t &len);
+
+    /* Append a record.  Nothing is written if it matches the newest one. */
+    bool save(uint16_t version, const uint8_t *data, size_t len);
+
+ private:
+    typedef struct {
+        uint16_t    magic;
+        uint16_t    version;    /* Payload schema version */
+        uint32_t    seq;        /* Increments with every save */
+        uint16_t    size;       /* Payload size */
+        uint16_t    reserved;
+        uint32_t    crc;        /* CRC32 of the above and the payload */
+    } record_t;
+
+    typedef struct {
+        uint32_t    seq;
+        uint32_t    pos;        /* Offset of the newest valid record */
+        uint32_t    end;        /* End of the newest valid record */
+        uint32_t    crc;
+        bool        valid;
+    } scan_t;
+
+    static uint32_t crc32(uint32_t crc, const uint8_t *data, size_t len);
+    scan_t scan(const char *name);
+    void select();
+
+    FS          *_fs;
+    const char  *_files[2];
+    size_t      _logSize;
+    uint8_t     _active = 0;    /* File the newest record is in */
+    scan_t      _newest = {};
+};
+
+#endif /* CONFIGSTORE_H_ */
@@ -0,0 +1,34 @@
+/*
+* DeviceState.h
+*
+* Project: ESPixelStick - An ESP8266 and E1.31 based pixel driver
+* Copyright (c) 2016 Shelby Merrick
+* http://www.forkineye.com
+*
+*  This program is provided free for you to use in any way that you wish,
+*  subject to the laws and regulations where you are using it.  Due diligence
+*  is strongly suggested before using this code.  Please give credit where due.
+*
+*  The Author makes no warranty of any kind, express or implied, with regard
+*  to this program or the documentation contained in this document.  The
+*  Author shall not be liable in any event for incidental or consequential
+*  damages in connection with, or arising out of, the furnishing, performance
+*  or use of these programs.
+*
+*/
+
+#ifndef DEVICESTATE_H_
+#define DEVICESTATE_H_
+
+#include <ArduinoJson.h>
+
+/* Sketch side sizing for the framework, kept in a header so the config
+   documents in Framework.cpp can be fixed size.  Change it along with
+   saveState(). */
+
+// JSON document size of the "device" object saveState() adds, e.g.
+// JSON_OBJECT_SIZE(members) plus room for any strings it copies. Strings
+// stored by reference need no room.
+#define DEVICE_STATE_JSON_SIZE  JSON_OBJECT_SIZE(6)
+
+#endif /* DEVICESTATE_H_ */
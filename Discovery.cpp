@@ -0,0 +1,248 @@
+/*
+* Discovery.cpp
+*
+* Project: ESPixelStick - An ESP8266 and E1.31 based pixel driver
+* Copyright (c) 2016 Shelby Merrick
+* http://www.forkineye.com
+*
+*  This program is provided free for you to use in any way that you wish,
+*  subject to the laws and regulations where you are using it.  Due diligence
+*  is strongly suggested before using this code.  Please give credit where due.
+*
+*  The Author makes no warranty of any kind, express or implied, with regard
+*  to this program or the documentation contained in this document.  The
+*  Author shall not be liable in any event for incidental or consequential
+*  damages in connection with, or arising out of, the furnishing, performance
+*  or use of these programs.
+*
+*/
+
+#include "Discovery.h"
+
+/* TXT changes are batched into at most one announcement per interval */
+#define ANNOUNCE_INTERVAL   1000
+
+bool Discovery::begin(const char *hostname, const char *instance) {
+    copyName(_hostname, sizeof(_hostname), hostname);
+    copyName(_instance, sizeof(_instance), instance);
+    MDNS.setInstanceName(_instance);
+    if (!MDNS.begin(_hostname))
+        return false;
+
+    _http = MDNS.addService(nullptr, "http", "tcp", _port);
+    _device = MDNS.addService(nullptr, _service, "tcp", _port);
+    for (uint8_t i = 0; i < _txtCount; i++) {
+        MDNS.addServiceTxt(_device, _txt[i].key, _txt[i].value);
+        _txt[i].dirty = false;
+    }
+    _txtDirty = false;
+
+    MDNS.installServiceQuery(_service, "tcp",
+            [this](MDNSResponder::MDNSServiceInfo info,
+                   MDNSResponder::AnswerType type, bool set) {
+                answer(info, type, set);
+            });
+
+    _started = true;
+    return true;
+}
+
+void Discovery::setHostname(const char *hostname, const char *instance) {
+    copyName(_hostname, sizeof(_hostname), hostname);
+    copyName(_instance, sizeof(_instance), instance);
+    if (!_started)
+        return;
+
+    MDNS.setHostname(_hostname);
+    MDNS.setServiceName(_http, _instance);
+    MDNS.setServiceName(_device, _instance);
+    MDNS.announce();
+}
+
+void Discovery::setTxt(const char *key, const char *value) {
+    txt_t *txt = nullptr;
+    for (uint8_t i = 0; i < _txtCount; i++) {
+        if (!strcmp(_txt[i].key, key)) {
+            txt = &_txt[i];
+            break;
+        }
+    }
+
+    if (!txt) {
+        if (_txtCount >= MAX_TXT)
+            return;
+        txt = &_txt[_txtCount++];
+        copyName(txt->key, sizeof(txt->key), key);
+        txt->value[0] = 0;
+    } else if (!strncmp(txt->value, value, sizeof(txt->value) - 1)) {
+        return;
+    }
+
+    copyName(txt->value, sizeof(txt->value), value);
+    txt->dirty = true;
+    _txtDirty = true;
+}
+
+void Discovery::setTxt(const char *key, uint32_t value) {
+    char buf[11];
+    utoa(value, buf, 10);
+    setTxt(key, buf);
+}
+
+void Discovery::update() {
+    if (!_started)
+        return;
+
+    // Answers to our query arrive from here, so do peers
+    MDNS.update();
+
+    if (_txtDirty && millis() - _lastAnnounce >= ANNOUNCE_INTERVAL) {
+        for (uint8_t i = 0; i < _txtCount; i++) {
+            if (_txt[i].dirty) {
+                // Replaces the value of an existing key
+                MDNS.addServiceTxt(_device, _txt[i].key, _txt[i].value);
+                _txt[i].dirty = false;
+            }
+        }
+        _txtDirty = false;
+        MDNS.announce();
+        _lastAnnounce = millis();
+    }
+}
+
+void Discovery::write(Print &out) {
+    uint32_t now = millis();
+
+    out.print('[');
+    for (uint8_t i = 0; i < _peerCount; i++) {
+        peer_t &peer = _peers[i];
+        if (i)
+            out.print(',');
+        out.print(F("{\"instance\":"));
+        writeString(out, peer.instance);
+        out.print(F(",\"host\":"));
+        writeString(out, peer.host);
+        out.print(F(",\"ip\":\""));
+        out.print(peer.ip);
+        out.print(F("\",\"port\":"));
+        out.print(peer.port);
+        out.print(F(",\"version\":"));
+        writeString(out, peer.version);
+        out.print(F(",\"id\":"));
+        writeString(out, peer.id);
+        out.print(F(",\"relay\":"));
+        writeString(out, peer.relay);
+        out.print(F(",\"uptime\":"));
+        out.print(peer.uptime);
+        out.print(F(",\"age\":"));
+        out.print((now - peer.seen) / 1000);
+        out.print('}');
+    }
+    out.print(']');
+}
+
+/* Query answers, called from MDNS.update() as each part of a peer's
+   records arrives or expires */
+void Discovery::answer(MDNSResponder::MDNSServiceInfo &info,
+        MDNSResponder::AnswerType type, bool set) {
+    // serviceDomain is <instance>._<service>._tcp.local
+    char instance[sizeof(peer_t::instance)];
+    const char *domain = info.serviceDomain();
+    if (!domain)
+        return;
+    const char *end = strstr(domain, "._");
+    size_t len = end ? (size_t)(end - domain) : strlen(domain);
+    if (len >= sizeof(instance))
+        len = sizeof(instance) - 1;
+    memcpy(instance, domain, len);
+    instance[len] = 0;
+
+    // Our own answers
+    if (!strcmp(instance, _instance))
+        return;
+
+    bool gone = !set && type == MDNSResponder::AnswerType::ServiceDomain;
+    peer_t *peer = findPeer(instance, !gone);
+    if (!peer)
+        return;
+
+    if (gone) {
+        *peer = _peers[--_peerCount];
+        return;
+    }
+
+    peer->seen = millis();
+    switch (type) {
+        case MDNSResponder::AnswerType::HostDomainAndPort:
+            if (info.hostDomainAvailable()) {
+                copyName(peer->host, sizeof(peer->host), info.hostDomain());
+                char *dot = strchr(peer->host, '.');
+                if (dot)
+                    *dot = 0;
+            }
+            if (info.hostPortAvailable())
+                peer->port = info.hostPort();
+            break;
+
+        case MDNSResponder::AnswerType::IP4Address:
+            if (info.IP4AddressAvailable() && set)
+                peer->ip = info.IP4Adresses()[0];
+            break;
+
+        case MDNSResponder::AnswerType::Txt:
+            if (info.txtAvailable() && set) {
+                const char *value;
+                if ((value = info.value("version")))
+                    copyName(peer->version, sizeof(peer->version), value);
+                if ((value = info.value("id")))
+                    copyName(peer->id, sizeof(peer->id), value);
+                if ((value = info.value("relay")))
+                    copyName(peer->relay, sizeof(peer->relay), value);
+                if ((value = info.value("uptime")))
+                    peer->uptime = strtoul(value, nullptr, 10);
+            }
+            break;
+
+        default:
+            break;
+    }
+}
+
+Discovery::peer_t *Discovery::findPeer(const char *instance, bool add) {
+    for (uint8_t i = 0; i < _peerCount; i++) {
+        if (!strcmp(_peers[i].instance, instance))
+            return &_peers[i];
+    }
+    if (!add)
+        return nullptr;
+
+    // Full, replace the one we heard from longest ago
+    peer_t *peer;
+    if (_peerCount < MAX_PEERS) {
+        peer = &_peers[_peerCount++];
+    } else {
+        peer = &_peers[0];
+        for (uint8_t i = 1; i < MAX_PEERS; i++) {
+            if ((int32_t)(_peers[i].seen - peer->seen) < 0)
+                peer = &_peers[i];
+        }
+    }
+    *peer = {};
+    copyName(peer->instance, sizeof(peer->instance), instance);
+    return peer;
+}
+
+/* Copy a name from the network, keeping only characters that are safe to
+   drop into JSON and TXT records */
+void Discovery::copyName(char *dest, size_t size, const char *src) {
+    size_t i = 0;
+    for (; src[i] && i < size - 1; i++)
+        dest[i] = (src[i] < ' ' || src[i] == '"' || src[i] == '\\') ? '_' : src[i];
+    dest[i] = 0;
+}
+
+void Discovery::writeString(Print &out, const char *s) {
+    out.print('"');
+    out.print(s);
+    out.print('"');
+}
@@ -0,0 +1,97 @@
+/*
+* Discovery.h
+*
+* Project: ESPixelStick - An ESP8266 and E1.31 based pixel driver
+* Copyright (c) 2016 Shelby Merrick
+* http://www.forkineye.com
+*
+*  This program is provided free for you to use in any way that you wish,
+*  subject to the laws and regulations where you are using it.  Due diligence
+*  is strongly suggested before using this code.  Please give credit where due.
+*
+*  The Author makes no warranty of any kind, express or implied, with regard
+*  to this program or the documentation contained in this document.  The
+*  Author shall not be liable in any event for incidental or consequential
+*  damages in connection with, or arising out of, the furnishing, performance
+*  or use of these programs.
+*
+*/
+
+#ifndef DISCOVERY_H_
+#define DISCOVERY_H_
+
+#include <ESP8266mDNS.h>
+
+/* mDNS / DNS-SD advertisement and discovery of other devices.  We
+   advertise http and our own device service, with TXT records that are
+   only pushed out (and announced) when a value changes.  A continuous
+   query for the device service keeps a table of peers, updated from the
+   answers as they arrive, so /peers never has to ask the network. */
+class Discovery {
+ public:
+    static const uint8_t MAX_PEERS = 32;
+    static const uint8_t MAX_TXT = 8;
+
+    typedef struct {
+        char        instance[33];   /* Service instance name */
+        char        host[33];       /* Without .local */
+        IPAddress   ip;
+        uint16_t    port;
+        char        version[12];
+        char        id[9];          /* Chip id in hex */
+        char        relay[4];
+        uint32_t    uptime;         /* s, as last advertised */
+        uint32_t    seen;           /* millis() of the last answer */
+    } peer_t;
+
+    Discovery(const char *service, uint16_t port) :
+            _service(service), _port(port) {}
+
+    /* Start the responder and the peer query, once we have an IP */
+    bool begin(const char *hostname, const char *instance);
+    /* Rename, announced straight away */
+    void setHostname(const char *hostname, const char *instance);
+    bool isStarted() { return _started; }
+    const char *getHostname() { return _hostname; }
+
+    /* Set a TXT record on the device service.  Nothing is sent unless the
+       value changed. */
+    void setTxt(const char *key, const char *value);
+    void setTxt(const char *key, uint32_t value);
+
+    /* Call often from the loop */
+    void update();
+
+    uint8_t getPeerCount() { return _peerCount; }
+    /* Peers as a JSON array */
+    void write(Print &out);
+
+ private:
+    typedef struct {
+        char    key[12];
+        char    value[24];
+        bool    dirty;
+    } txt_t;
+
+    void answer(MDNSResponder::MDNSServiceInfo &info,
+            MDNSResponder::AnswerType type, bool set);
+    peer_t *findPeer(const char *instance, bool add);
+    static void copyName(char *dest, size_t size, const char *src);
+    static void writeString(Print &out, const char *s);
+
+    const char                      *_service;
+    uint16_t                        _port;
+    bool                            _started = false;
+    char                            _hostname[33] = "";
+    char                            _instance[33] = "";
+    MDNSResponder::hMDNSService     _http = nullptr;
+    MDNSResponder::hMDNSService     _device = nullptr;
+    txt_t                           _txt[MAX_TXT];
+    uint8_t                         _txtCount = 0;
+    bool                            _txtDirty = false;
+    uint32_t                        _lastAnnounce = 0;
+    peer_t                          _peers[MAX_PEERS];
+    uint8_t                         _peerCount = 0;
+};
+
+#endif /* DISCOVERY_H_ */
@@ -22,76 +22,125 @@
 #include <lwip/def.h>
 #include "EFUpdate.h"
 
+void EFUpdate::setPublicKey(const uint8_t *key, size_t len) {
+    _key.curve = BR_EC_secp256r1;
+    _key.q = const_cast<unsigned char *>(key);
+    _key.qlen = len;
+}
+
 void EFUpdate::begin() {
+    // Drop whatever an abandoned upload left behind
+    abortImage();
+
     _maxSketchSpace = (ESP.getFreeSketchSpace() - 0x1000) & 0xFFFFF000;
     _state = State::HEADER;
     _loc = 0;
+    _offset = 0;
     _error = EFUPDATE_ERROR_OK;
+    br_sha256_init(&_digest);
+}
+
+uint32_t EFUpdate::getOffset() {
+    return _offset;
+}
+
+bool EFUpdate::resume(uint32_t offset) {
+    // All state, including the Updater's, is still in RAM, so any offset
+    // we've reached is a clean place to continue from
+    return _state != State::FAIL && offset == _offset;
 }
 
 bool EFUpdate::process(uint8_t *data, size_t len) {
     size_t index = 0;
     bool retval = true;
 
+    // Each state consumes the largest span of the chunk it can in one go
     while (index < len) {
+        size_t avail = len - index;
+        size_t toCopy;
+
         switch (_state) {
             case State::HEADER:
-                _header.raw[_loc++] = data[index++];
+                toCopy = (sizeof(efuheader_t) - _loc < avail) ? sizeof(efuheader_t) - _loc : avail;
+                memcpy(_header.raw + _loc, data + index, toCopy);
+                index = index + toCopy;
+                _loc = _loc + toCopy;
+
                 if (_loc == sizeof(efuheader_t)) {
+                    br_sha256_update(&_digest, _header.raw, sizeof(efuheader_t));
                     if (_header.signature == EFU_ID) {
                         _header.version = ntohs(_header.version);
                         memset(&_record, 0, sizeof(efurecord_t));
                         _loc = 0;
                         _state = State::RECORD;
                     } else {
-                        _state = State::FAIL;
-                        _error = EFUPDATE_ERROR_SIG;
+                        fail(EFUPDATE_ERROR_SIG);
                     }
                 }
                 break;
             case State::RECORD:
-                _record.raw[_loc++] = data[index++];
+                toCopy = (sizeof(efurecord_t) - _loc < avail) ? sizeof(efurecord_t) - _loc : avail;
+                memcpy(_record.raw + _loc, data + index, toCopy);
+                index = index + toCopy;
+                _loc = _loc + toCopy;
+
                 if (_loc == sizeof(efurecord_t)) {
+                    // Signatures cover everything ahead of their own record
+                    if (RecordType(ntohs((uint16_t)_record.type)) != RecordType::SIGNATURE)
+                        br_sha256_update(&_digest, _record.raw, sizeof(efurecord_t));
                     _record.type = RecordType(ntohs((uint16_t)_record.type));
                     _record.size = ntohl(_record.size);
                     _loc = 0;
-                    if (_record.type == RecordType::SKETCH_IMAGE) {
-                        // Begin sketch update
-                        if (!Update.begin(_record.size, U_FLASH)) {
-                            _state = State::FAIL;
-                            _error = Update.getError();
-                        } else {
-                            _state = State::DATA;
-                        }
-                    } else if (_record.type == RecordType::SPIFFS_IMAGE) {
-                        // Begin spiffs update
-                        if (!Update.begin(_record.size, U_FS)) {
-                            _state = State::FAIL;
-                            _error = Update.getError();
-                        } else {
-                            _state = State::DATA;
-                        }
-                    } else {
-                        _state = State::FAIL;
-                        _error = EFUPDATE_ERROR_REC;
-                    }
+                    beginRecord();
                 }
                 break;
             case State::DATA:
-                size_t toWrite;
+                toCopy = (_record.size - _loc < avail) ? _record.size - _loc : avail;
+                br_sha256_update(&_digest, data + index, toCopy);
+                if (!writeImage(data + index, toCopy))
+                    break;
+                index = index + toCopy;
+                _loc = _loc + toCopy;
 
-                toWrite = (_record.size - _loc < len) ? _record.size - _loc : len - index;
-                Update.write(data + index, toWrite);
-                index = index + toWrite;
-                _loc = _loc + toWrite;
+                if (_record.size == _loc)
+                    endRecord();
+                break;
+            case State::PREFIX:
+                // Compressed records lead with the uncompressed image size
+                toCopy = (_prefixLen - _loc < avail) ? _prefixLen - _loc : avail;
+                memcpy(_prefix.raw + _loc, data + index, toCopy);
+                br_sha256_update(&_digest, data + index, toCopy);
+                index = index + toCopy;
+                _loc = _loc + toCopy;
 
-                if (_record.size == _loc) {
-                    Update.end(true);
-                    memset(&_record, 0, sizeof(efurecord_t));
-                    _loc = 0;
-                    _state = State::RECORD;
+                if (_loc == _prefixLen) {
+                    _imageSize = ntohl(_prefix.size);
+                    beginImage(State::INFLATE);
+                }
+                break;
+            case State::INFLATE:
+                toCopy = (_record.size - _loc < avail) ? _record.size - _loc : avail;
+                br_sha256_update(&_digest, data + index, toCopy);
+                _loc = _loc + toCopy;
+                inflate(data + index, toCopy);
+                index = index + toCopy;
+
+                if (_state == State::INFLATE && _record.size == _loc) {
+                    if (_written != _imageSize)
+                        fail(EFUPDATE_ERROR_INFLATE);
+                    else
+                        endRecord();
                 }
                 break;
+            case State::SIGNATURE:
+                toCopy = (EFU_SIG_LEN - _loc < avail) ? EFU_SIG_LEN - _loc : avail;
+                memcpy(_sig + _loc, data + index, toCopy);
+                index = index + toCopy;
+                _loc = _loc + toCopy;
+
+                if (_loc == EFU_SIG_LEN)
+                    verifySignature();
+                break;
             case State::FAIL:
                 index = len;
                 retval = false;
@@ -99,9 +148,268 @@ bool EFUpdate::process(uint8_t *data, size_t len) {
         }
     }
 
+    // A chunk that drives us into FAIL reports it right away
+    if (_state == State::FAIL)
+        retval = false;
+    _offset = _offset + len;
+
     return retval;
 }
 
+void EFUpdate::beginRecord() {
+    if (_record.type == RecordType::SIGNATURE) {
+        if (_record.size != EFU_SIG_LEN) {
+            fail(EFUPDATE_ERROR_REC);
+        } else {
+            _state = State::SIGNATURE;
+        }
+    } else if (_pending) {
+        // Previous image was never signed
+        fail(EFUPDATE_ERROR_UNSIGNED);
+    } else if (_record.type == RecordType::SKETCH_IMAGE) {
+        // Begin sketch update
+        _command = U_FLASH;
+        _imageSize = _record.size;
+        beginImage(State::DATA);
+    } else if (_record.type == RecordType::SPIFFS_IMAGE) {
+        // Begin spiffs update
+        _command = U_FS;
+        _imageSize = _record.size;
+        beginImage(State::DATA);
+    } else if (_record.type == RecordType::SKETCH_IMAGE_DEFLATE ||
+               _record.type == RecordType::SPIFFS_IMAGE_DEFLATE ||
+               _record.type == RecordType::SKETCH_PATCH) {
+        // Compressed update, begins once the prefix is in
+        _command = (_record.type == RecordType::SPIFFS_IMAGE_DEFLATE) ? U_FS : U_FLASH;
+        _prefixLen = (_record.type == RecordType::SKETCH_PATCH) ? sizeof(efuprefix_t) : sizeof(_prefix.size);
+        if (_record.size <= _prefixLen) {
+            fail(EFUPDATE_ERROR_REC);
+        } else {
+            _state = State::PREFIX;
+        }
+    } else {
+        fail(EFUPDATE_ERROR_REC);
+    }
+}
+
+void EFUpdate::beginImage(State state) {
+    if (state == State::INFLATE) {
+        _inflate = static_cast<efuinflate_t *>(malloc(sizeof(efuinflate_t)));
+        if (!_inflate) {
+            fail(EFUPDATE_ERROR_MEM);
+            return;
+        }
+        tinfl_init(&_inflate->decomp);
+        _windowPos = 0;
+    }
+
+    if (_record.type == RecordType::SKETCH_PATCH) {
+        // Patches only apply to the exact sketch they were made against
+        char md5[33];
+        for (uint8_t i = 0; i < sizeof(_prefix.source); i++)
+            sprintf(md5 + i * 2, "%02x", _prefix.source[i]);
+        if (ESP.getSketchMD5() != md5) {
+            fail(EFUPDATE_ERROR_SOURCE);
+            return;
+        }
+
+        memset(&_inflate->patch, 0, sizeof(efupatch_t));
+        _inflate->patch.oldSize = ESP.getSketchSize();
+        _inflate->patch.oldBase = UINT32_MAX;
+    }
+
+    _written = 0;
+    if (!Update.begin(_imageSize, _command)) {
+        fail(Update.getError());
+        return;
+    }
+    _state = state;
+}
+
+bool EFUpdate::writeImage(uint8_t *data, size_t len) {
+    // Compressed streams can claim more than their stated size
+    if (len > _imageSize - _written) {
+        fail(EFUPDATE_ERROR_INFLATE);
+        return false;
+    }
+
+    // With a key installed the final byte is held back so the Updater
+    // can't finish (and commit) before the signature checks out
+    if (len && _key.q && _written + len == _imageSize) {
+        _holdback = data[--len];
+        _written++;
+    }
+
+    if (Update.write(data, len) != len) {
+        fail(Update.getError());
+        return false;
+    }
+    _written = _written + len;
+    return true;
+}
+
+void EFUpdate::inflate(uint8_t *data, size_t len) {
+    mz_uint32 flags = TINFL_FLAG_PARSE_ZLIB_HEADER;
+    tinfl_status status;
+
+    if (_loc < _record.size)
+        flags |= TINFL_FLAG_HAS_MORE_INPUT;
+
+    // Decode into the wrapping window and flush each run straight to the
+    // Updater, so only the window is ever held
+    do {
+        size_t in = len;
+        size_t out = EFU_INFLATE_WINDOW - _windowPos;
+
+        status = tinfl_decompress(&_inflate->decomp, data, &in, _inflate->window,
+                _inflate->window + _windowPos, &out, flags);
+        data = data + in;
+        len = len - in;
+
+        if (status < TINFL_STATUS_DONE) {
+            fail(EFUPDATE_ERROR_INFLATE);
+            return;
+        }
+        if (_record.type == RecordType::SKETCH_PATCH) {
+            if (!applyPatch(_inflate->window + _windowPos, out))
+                return;
+        } else if (!writeImage(_inflate->window + _windowPos, out)) {
+            return;
+        }
+        _windowPos = (_windowPos + out) & (EFU_INFLATE_WINDOW - 1);
+    } while (status == TINFL_STATUS_HAS_MORE_OUTPUT);
+
+    // Trailing bytes past the end of the deflate stream
+    if (status == TINFL_STATUS_DONE && len)
+        fail(EFUPDATE_ERROR_INFLATE);
+}
+
+bool EFUpdate::applyPatch(uint8_t *data, size_t len) {
+    efupatch_t &patch = _inflate->patch;
+
+    while (len) {
+        size_t span;
+
+        if (patch.diff) {
+            // Add the running sketch back in.  The window is also the
+            // inflate dictionary, so the sum goes through a scratch block.
+            span = (patch.diff < len) ? patch.diff : len;
+            for (size_t i = 0; i < span;) {
+                if (patch.oldPos >= patch.oldSize) {
+                    fail(EFUPDATE_ERROR_PATCH);
+                    return false;
+                }
+                if (patch.oldPos < patch.oldBase || patch.oldPos - patch.oldBase >= sizeof(patch.old)) {
+                    patch.oldBase = patch.oldPos & ~3;
+                    if (!ESP.flashRead(patch.oldBase, patch.old, sizeof(patch.old))) {
+                        fail(EFUPDATE_ERROR_PATCH);
+                        return false;
+                    }
+                }
+
+                const uint8_t *old = reinterpret_cast<uint8_t *>(patch.old) + (patch.oldPos - patch.oldBase);
+                size_t run = patch.oldBase + sizeof(patch.old) - patch.oldPos;
+                if (run > span - i)
+                    run = span - i;
+                if (run > patch.oldSize - patch.oldPos)
+                    run = patch.oldSize - patch.oldPos;
+
+                for (size_t j = 0; j < run; j++)
+                    patch.out[j] = data[i + j] + old[j];
+                if (!writeImage(patch.out, run))
+                    return false;
+                i = i + run;
+                patch.oldPos = patch.oldPos + run;
+            }
+            patch.diff = patch.diff - span;
+        } else if (patch.extra) {
+            span = (patch.extra < len) ? patch.extra : len;
+            if (!writeImage(data, span))
+                return false;
+            patch.extra = patch.extra - span;
+        } else {
+            span = (sizeof(patch.control) - patch.controlLoc < len) ? sizeof(patch.control) - patch.controlLoc : len;
+            memcpy(patch.control + patch.controlLoc, data, span);
+            patch.controlLoc = patch.controlLoc + span;
+
+            if (patch.controlLoc == sizeof(patch.control)) {
+                uint32_t field[3];
+                memcpy(field, patch.control, sizeof(field));
+                patch.oldPos = patch.oldPos + (int32_t)ntohl(field[0]);
+                patch.diff = ntohl(field[1]);
+                patch.extra = ntohl(field[2]);
+                patch.controlLoc = 0;
+            }
+        }
+
+        data = data + span;
+        len = len - span;
+    }
+
+    return true;
+}
+
+void EFUpdate::endRecord() {
+    free(_inflate);
+    _inflate = nullptr;
+
+    if (_key.q) {
+        _pending = true;
+    } else {
+        Update.end(true);
+    }
+    memset(&_record, 0, sizeof(efurecord_t));
+    _loc = 0;
+    _state = State::RECORD;
+}
+
+void EFUpdate::verifySignature() {
+    uint8_t hash[br_sha256_SIZE];
+    efurecord_t rec;
+
+    // Without a key there is nothing to check against, so the record is skipped
+    br_sha256_out(&_digest, hash);
+    if (_key.q && !br_ecdsa_i15_vrfy_raw(&br_ec_p256_m15, hash, sizeof(hash),
+            &_key, _sig, EFU_SIG_LEN)) {
+        fail(EFUPDATE_ERROR_VERIFY);
+        return;
+    }
+
+    if (_pending) {
+        // Release the held back byte, which completes the image, then commit
+        if (Update.write(&_holdback, 1) != 1 || !Update.end(true)) {
+            fail(Update.getError());
+            return;
+        }
+        _pending = false;
+    }
+
+    // Chain the signature record into the digest for any later signatures
+    rec.type = RecordType(htons((uint16_t)RecordType::SIGNATURE));
+    rec.size = htonl(EFU_SIG_LEN);
+    br_sha256_update(&_digest, rec.raw, sizeof(efurecord_t));
+    br_sha256_update(&_digest, _sig, EFU_SIG_LEN);
+
+    memset(&_record, 0, sizeof(efurecord_t));
+    _loc = 0;
+    _state = State::RECORD;
+}
+
+void EFUpdate::fail(uint8_t error) {
+    abortImage();
+    _state = State::FAIL;
+    _error = error;
+}
+
+void EFUpdate::abortImage() {
+    // Drop a pending image so nothing half-verified gets committed
+    if (_pending || _state == State::DATA || _state == State::INFLATE)
+        Update.end(false);
+    _pending = false;
+    free(_inflate);
+    _inflate = nullptr;
+}
+
 bool EFUpdate::hasError() {
     return _error != EFUPDATE_ERROR_OK;
 }
@@ -111,6 +419,10 @@ uint8_t EFUpdate::getError() {
 }
 
 bool EFUpdate::end() {
+    // Stream ended with an image still waiting on its signature
+    if (_pending)
+        fail(EFUPDATE_ERROR_UNSIGNED);
+
     if (_state == State::FAIL)
         return false;
     else
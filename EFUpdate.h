@@ -20,27 +20,59 @@
 #ifndef EFUPDATE_H_
 #define EFUPDATE_H_
 
-#define EFUPDATE_ERROR_OK   (0)
-#define EFUPDATE_ERROR_SIG  (100)
-#define EFUPDATE_ERROR_REC  (101)
+#include <bearssl/bearssl.h>
+#include "tinfl.h"
+
+#define EFUPDATE_ERROR_OK       (0)
+#define EFUPDATE_ERROR_SIG      (100)
+#define EFUPDATE_ERROR_REC      (101)
+#define EFUPDATE_ERROR_VERIFY   (102)   /* Signature does not match image */
+#define EFUPDATE_ERROR_UNSIGNED (103)   /* Image not followed by a signature */
+#define EFUPDATE_ERROR_INFLATE  (104)   /* Corrupt or oversized compressed image */
+#define EFUPDATE_ERROR_MEM      (105)   /* No memory for the inflate window */
+#define EFUPDATE_ERROR_SOURCE   (106)   /* Patch is not for the running sketch */
+#define EFUPDATE_ERROR_PATCH    (107)   /* Corrupt patch */
 
 class EFUpdate {
  public:
     const uint32_t EFU_ID = 0x00554645;     // 'E', 'F', 'U', 0x00
 
+    /* ECDSA P-256 raw (r || s) signature length */
+    static const size_t EFU_SIG_LEN = 64;
+
+    /* Inflate window.  Compressed images must be deflated with a window no
+       larger than this (zlib wbits 12). */
+    static const size_t EFU_INFLATE_WINDOW = 4096;
+
+    /* Require every image record to be followed by a SIGNATURE record
+       verified against this uncompressed P-256 public key (0x04 || X || Y).
+       The key is not copied and must outlive this object. */
+    void setPublicKey(const uint8_t *key, size_t len);
+
     void begin();
     bool process(uint8_t *data, size_t len);
     bool hasError();
     uint8_t getError();
     bool end();
 
+    /* Bytes taken by process() since begin() */
+    uint32_t getOffset();
+
+    /* Pick an interrupted update back up.  The upload must continue from
+       exactly getOffset(); anything else can't be resumed. */
+    bool resume(uint32_t offset);
+
  private:
     /* Record types */
     enum class RecordType : uint16_t {
         NULL_RECORD,
         SKETCH_IMAGE,
         SPIFFS_IMAGE,
-        EEPROM_IMAGE
+        EEPROM_IMAGE,
+        SIGNATURE,
+        SKETCH_IMAGE_DEFLATE,
+        SPIFFS_IMAGE_DEFLATE,
+        SKETCH_PATCH
     };
 
     /* Update State */
@@ -48,6 +80,9 @@ class EFUpdate {
         HEADER,
         RECORD,
         DATA,
+        PREFIX,
+        INFLATE,
+        SIGNATURE,
         FAIL
     };
 
@@ -71,12 +106,70 @@ class EFUpdate {
         uint8_t raw[6];
     } efurecord_t;
 
+    /* Compressed record prefix, ahead of the zlib stream */
+    typedef union {
+        struct {
+            uint32_t    size;           /* Uncompressed image size */
+            uint8_t     source[16];     /* Patches only, MD5 of the sketch patched */
+        } __attribute__((packed));
+
+        uint8_t raw[20];
+    } efuprefix_t;
+
+    /* Patch state.  A patch is a run of control blocks (int32 seek, uint32
+       diff, uint32 extra) each followed by <diff> bytes to add to the
+       running sketch at the seeked position and <extra> literal bytes. */
+    typedef struct {
+        uint8_t     control[12];
+        size_t      controlLoc;
+        uint32_t    diff;           /* Bytes left to add to the old sketch */
+        uint32_t    extra;          /* Bytes left to copy as-is */
+        uint32_t    oldSize;        /* Running sketch size */
+        uint32_t    oldPos;         /* Read position in the running sketch */
+        uint32_t    oldBase;        /* Flash offset of the cached block */
+        uint32_t    old[64];        /* Cached block of the running sketch */
+        uint8_t     out[256];       /* Patched bytes on their way out */
+    } efupatch_t;
+
+    /* Inflate state, only allocated while a compressed image streams */
+    typedef struct {
+        tinfl_decompressor  decomp;
+        uint8_t             window[EFU_INFLATE_WINDOW];
+        efupatch_t          patch;
+    } efuinflate_t;
+
+    void beginRecord();
+    void beginImage(State state);
+    bool writeImage(uint8_t *data, size_t len);
+    void inflate(uint8_t *data, size_t len);
+    bool applyPatch(uint8_t *data, size_t len);
+    void endRecord();
+    void verifySignature();
+    void fail(uint8_t error);
+    void abortImage();
+
     State       _state = State::FAIL;
     size_t     _loc = 0;
+    uint32_t    _offset = 0;
     efuheader_t _header;
     efurecord_t _record;
     uint32_t    _maxSketchSpace;
     uint8_t     _error;
+    int         _command;       /* Updater command of the current image */
+    uint32_t    _imageSize;     /* Uncompressed size of the current image */
+    efuprefix_t _prefix;
+    size_t      _prefixLen;
+    uint32_t    _written;       /* Image bytes handed to the Updater */
+    efuinflate_t *_inflate = nullptr;
+    size_t      _windowPos;
+
+    /* Signing - the digest runs over every byte ahead of each SIGNATURE
+       record, so images are verified as they stream with no flash re-read */
+    br_sha256_context   _digest;
+    br_ec_public_key    _key = { BR_EC_secp256r1, nullptr, 0 };
+    uint8_t     _sig[EFU_SIG_LEN];
+    bool        _pending = false;   /* Image written, awaiting signature */
+    uint8_t     _holdback;          /* Last image byte, held until verified */
 };
 
 #endif /* EFUPDATE_H_ */
@@ -1,4 +1,8 @@
 #include "Framework.h"
+#include "Trigger.h"
+#include "StatusDisplay.h"
+#include "ActionQueue.h"
+#include <Ticker.h>
 #include <Adafruit_GFX.h>
 #include <Adafruit_SSD1306.h>
 
@@ -6,7 +10,9 @@
 #define SCREEN_WIDTH 128   // OLED display width, in pixels
 #define SCREEN_HEIGHT 32   // OLED display height, in pixels 
 #define OLED_RESET   -1    // define SSD1306 OLED (-1 means none)
+#define OLED_ADDRESS 0x3C  // I2C address of the 128x32 display
 Adafruit_SSD1306 display(SCREEN_WIDTH, SCREEN_HEIGHT, &Wire, OLED_RESET);
+StatusDisplay    statusDisplay(display, Wire, OLED_ADDRESS);
 
 const int forceAccessPointPin = D5;   // Connect to ground to force access point.
 #define RELAY_PIN D6
@@ -17,43 +23,234 @@ const int forceAccessPointPin = D5;   // Connect to ground to force access point
 String deviceName = "Default";
 int    millisOn = 2000;
 int    millisOff = 2000;
+int    beamMode = Trigger::PULSE;
+int    pirMode = Trigger::DISABLED;
 bool   blinking = true;
+int    commandGroup = 0;   // Multicast UDP command group, 0 for none
+
+// Relay trigger inputs, in the order they're added to the trigger.
+Trigger trigger;
+#define BEAM_INPUT 0
+#define PIR_INPUT  1
 
 // Was AP request at start.
 bool   startupRequestAP = false;
 
-void led_on_request(AsyncWebServerRequest * request)
-{
+// Relay actions scheduled against the shared wall clock, posted to
+// /actions as {"base": epoch s, "actions": [[offset ms, "on"], ...]} in
+// JSON or MessagePack. "clear": true drops anything already queued.
+// "pulse" takes the on time in ms as a third element. The same actions
+// are taken as UDP commands, see tools/udpcmd.py.
+enum RelayAction : uint8_t { ACTION_ON, ACTION_OFF, ACTION_BLINK, ACTION_PULSE };
+#define ACTIONS_MAX_BODY  1024
+#define ACTIONS_JSON_SIZE (JSON_OBJECT_SIZE(3) + \
+                           JSON_ARRAY_SIZE(ActionQueue::MAX_ACTIONS) + \
+                           ActionQueue::MAX_ACTIONS * JSON_ARRAY_SIZE(3))
+#define ACTIONS_MAX_LATE  1000  // ms, older actions are rejected
+ActionQueue actions;
+Ticker      pulseTicker;
+
+// Each of these overrides a pulse in progress.
+void relayOn() {
+  pulseTicker.detach();
+  blinking = false;
+  trigger.setEnabled(blinking);
   digitalWrite(RELAY_PIN, LOW);
+  framework_publish_event("mode", "on");
+}
+
+void relayOff() {
+  pulseTicker.detach();
   blinking = false;
+  trigger.setEnabled(blinking);
+  digitalWrite(RELAY_PIN, HIGH);
+  framework_publish_event("mode", "off");
+}
+
+void relayBlink() {
+  pulseTicker.detach();
+  blinking = true;
+  trigger.setEnabled(blinking);
+  framework_publish_event("mode", "blink");
+}
+
+void relayPulse(uint32_t ms) {
+  relayOn();
+  pulseTicker.once_ms(ms ? ms : millisOn, relayOff);
+}
+
+void led_on_request(AsyncWebServerRequest * request)
+{
+  relayOn();
   request->send(200, "text/plain", "Relay is ON!");
 }
 
 void led_off_request(AsyncWebServerRequest * request)
 {
-  digitalWrite(RELAY_PIN, HIGH);
-  blinking = false;
+  relayOff();
   request->send(200, "text/plain", "Relay is OFF!");
 }
 
 void led_blink_request(AsyncWebServerRequest * request)
 {
-  blinking = true;
+  relayBlink();
   request->send(200, "text/plain", "Relay is blinking!");
 }
 
+// Run from the action queue's timer or a UDP command.
+bool runAction(uint8_t action, uint32_t arg)
+{
+  switch (action) {
+    case ACTION_ON:    relayOn();        return true;
+    case ACTION_OFF:   relayOff();       return true;
+    case ACTION_BLINK: relayBlink();     return true;
+    case ACTION_PULSE: relayPulse(arg);  return true;
+  }
+  return false;
+}
+
+// SNTP stepped the clock, actions are due at different millis() now.
+void rearmActions()
+{
+  actions.rearm();
+}
+
+// Collect the body, freed with the request.
+void actions_body(AsyncWebServerRequest * request, uint8_t *data, size_t len,
+                  size_t index, size_t total)
+{
+  if (total > ACTIONS_MAX_BODY)
+    return;
+  if (!index)
+    request->_tempObject = malloc(total);
+  if (request->_tempObject)
+    memcpy((uint8_t *)request->_tempObject + index, data, len);
+}
+
+String actions_status(uint64_t now, bool synced, uint8_t rejected = 0)
+{
+  return "{\"pending\":" + String(actions.count()) +
+         ",\"rejected\":" + String(rejected) +
+         ",\"run\":" + String(actions.getRun()) +
+         ",\"maxLateMs\":" + String(actions.getMaxLate()) +
+         ",\"synced\":" + String(synced ? "true" : "false") +
+         ",\"time\":" + String((uint32_t)(now / 1000)) +
+         ",\"ms\":" + String((uint32_t)(now % 1000)) + "}";
+}
+
+void actions_request(AsyncWebServerRequest * request)
+{
+  uint64_t now = 0;
+  bool synced = framework_time(now);
+
+  if (request->method() == HTTP_GET) {
+    request->send(200, "application/json", actions_status(now, synced));
+    return;
+  }
+
+  if (!synced) {
+    request->send(503, "text/plain", "Clock not synced");
+    return;
+  }
+  if (request->contentLength() > ACTIONS_MAX_BODY) {
+    request->send(413, "text/plain", "Too many actions");
+    return;
+  }
+  if (!request->_tempObject) {
+    request->send(400, "text/plain", "No actions");
+    return;
+  }
+
+  // Parsed in place, the strings stay in the body buffer
+  DynamicJsonDocument json(ACTIONS_JSON_SIZE);
+  char *body = (char *)request->_tempObject;
+  DeserializationError error = request->contentType() == "application/msgpack" ?
+      deserializeMsgPack(json, body, request->contentLength()) :
+      deserializeJson(json, body, request->contentLength());
+  if (error) {
+    request->send(400, "text/plain", error.c_str());
+    return;
+  }
+
+  if (json["clear"])
+    actions.clear();
+
+  uint64_t base = (uint64_t)json["base"].as<uint32_t>() * 1000;
+  uint8_t rejected = 0;
+  for (JsonVariant entry : json["actions"].as<JsonArray>()) {
+    uint64_t at = base + entry[0].as<uint32_t>();
+    const char *what = entry[1];
+    int8_t action = !what ? -1 :
+                    !strcmp(what, "on") ? ACTION_ON :
+                    !strcmp(what, "off") ? ACTION_OFF :
+                    !strcmp(what, "blink") ? ACTION_BLINK :
+                    !strcmp(what, "pulse") ? ACTION_PULSE : -1;
+    if (action < 0 || at + ACTIONS_MAX_LATE < now ||
+        !actions.add(at, action, entry[2].as<uint32_t>()))
+      rejected++;
+  }
+
+  request->send(200, "application/json", actions_status(now, synced, rejected));
+}
+
+void trigger_request(AsyncWebServerRequest * request)
+{
+  String response = "{\"count\":" + String(trigger.getCount()) +
+                    ",\"lastLatencyUs\":" + String(trigger.getLastLatency()) +
+                    ",\"maxLatencyUs\":" + String(trigger.getMaxLatency()) + "}";
+  request->send(200, "application/json", response);
+}
+
+// Relay timing, never blocks.
+void triggerTask() {
+  static uint32_t lastCount = 0;
+  static int relay = -1;
+
+  trigger.handle();
+
+  if (digitalRead(RELAY_PIN) != relay) {
+    relay = digitalRead(RELAY_PIN);
+    framework_set_service_txt("relay", relay ? "1" : "0");
+    framework_publish_event("relay", relay ? "1" : "0");
+  }
+
+  if (trigger.getCount() != lastCount) {
+    lastCount = trigger.getCount();
+    framework_log_event(EVENT_TRIGGER, trigger.getLastInput(), trigger.getLastLatency());
+    framework_publish_event("trigger", String(lastCount).c_str());
+  }
+}
+
+void apSwitchTask() {
+  // If the AP switch is closed, but wasn't closed at startup, restart to
+  // enter AP mode.
+  if (!startupRequestAP && digitalRead(forceAccessPointPin) == LOW) {
+    ESP.restart();
+  }
+
+  // If the AP switch is open, but was closed at startup, restart to exit
+  // AP mode
+  if (startupRequestAP && digitalRead(forceAccessPointPin) == HIGH) {
+    ESP.restart();
+  }
+}
+
 void setup() {
   pinMode(forceAccessPointPin, INPUT_PULLUP);
-  pinMode(RELAY_PIN, OUTPUT);
-  digitalWrite(RELAY_PIN, LOW);
 
   pinMode(PIR_TRIGGER_PIN, INPUT_PULLUP);
   pinMode(BEAM_TRIGGER_PIN, INPUT_PULLUP);
 
+  // Relay is driven HIGH while triggered. Timing and modes are set again
+  // by loadState() once the config is loaded.
+  trigger.begin(RELAY_PIN, HIGH);
+  trigger.addInput(BEAM_TRIGGER_PIN, LOW, (Trigger::Mode)beamMode);
+  trigger.addInput(PIR_TRIGGER_PIN, HIGH, (Trigger::Mode)pirMode);
+
   // Initialise OLED display.
   Wire.begin(4, 0);           // set I2C pins [SDA = GPIO4 (D2), SCL = GPIO0 (D3)], default clock is 100kHz
   Wire.setClock(400000L);     // set I2C clock to 400kHz
-  display.begin(SSD1306_SWITCHCAPVCC, 0x3C);  // initialize with the I2C addr 0x3C (for the 128x32)
+  display.begin(SSD1306_SWITCHCAPVCC, OLED_ADDRESS);  // initialize with the I2C addr 0x3C (for the 128x32)
 
   // Show initial message on the screen
   display.clearDisplay();
@@ -68,25 +265,34 @@ void setup() {
   startupRequestAP = (digitalRead(forceAccessPointPin) == LOW); 
   AsyncWebServer * webServer = framework_setup(startupRequestAP);
 
+  // Jobs run by the framework scheduler.
+  framework_add_task("trigger", triggerTask, 0, TASK_PRIORITY_HIGH, 200);
+  framework_add_task("apswitch", apSwitchTask, 100, TASK_PRIORITY_LOW);
+  actions.begin(runAction, framework_time);
+  framework_on_time_sync(rearmActions);
+  framework_on_command(runAction);
+
+  // Initial state for /events clients
+  framework_publish_event("mode", blinking ? "blink" : "off");
+
   // Set up request handlers on the web interface.
   // See https://github.com/me-no-dev/ESPAsyncWebServer
   if (webServer) {
     webServer->on("/on", HTTP_GET, led_on_request);
     webServer->on("/off", HTTP_GET, led_off_request);
     webServer->on("/blink", HTTP_GET, led_blink_request);
+    webServer->on("/trigger", HTTP_GET, trigger_request);
+    webServer->on("/actions", HTTP_GET | HTTP_POST, actions_request, nullptr, actions_body);
   }
 }
 
 // Update the status on the OLED display.
 // Called from the framework whenever the network status updates
 // or every 2 seconds. Always called in a place it is safe.
+// Only the characters that changed since the last call are sent.
 void updateStatus(const connection_status_t & connectionStatus)
 {
-  display.clearDisplay();
-  display.setTextSize(1);      // Normal 1:1 pixel scale
-  display.setTextColor(SSD1306_WHITE); // Draw white text
-  display.setCursor(0, 0);     // Start at top-left corner
-  display.cp437(true);         // Use full 256 char 'Code Page 437' font
+  statusDisplay.clear();
 
   const char * statusText;
   switch (connectionStatus.status) {
@@ -100,36 +306,39 @@ void updateStatus(const connection_status_t & connectionStatus)
     case CONNSTAT_LOCALAP:
       statusText = "Local AP"; break;
   }
-  display.setTextColor(SSD1306_BLACK, SSD1306_WHITE); // Draw 'inverse' text
-  display.print(deviceName);
-  display.setTextColor(SSD1306_WHITE, SSD1306_BLACK); // Draw regular text
-  display.print(" ");
-  display.println(statusText);
+  uint8_t col = statusDisplay.print(0, 0, deviceName.c_str(), true); // 'inverse' text
+  col = statusDisplay.print(0, col, " ");
+  statusDisplay.print(0, col, statusText);
 
   if (connectionStatus.status != CONNSTAT_NONE) {
-    display.print("SSID: ");
-    display.println(connectionStatus.ssid);
+    col = statusDisplay.print(1, 0, "SSID: ");
+    statusDisplay.print(1, col, connectionStatus.ssid.c_str());
   }
 
   if (connectionStatus.status == CONNSTAT_CONNECTED || connectionStatus.status == CONNSTAT_LOCALAP) {
-    display.print("IP: ");
-    display.println(connectionStatus.ourLocalIP);
+    col = statusDisplay.print(2, 0, "IP: ");
+    statusDisplay.print(2, col, connectionStatus.ourLocalIP.toString().c_str());
   }
 
   if (connectionStatus.status == CONNSTAT_CONNECTED) {
-    display.setCursor(114, 8);
-    display.println(connectionStatus.signalStrength);
+    // Right aligned on the SSID line
+    String signal(connectionStatus.signalStrength);
+    statusDisplay.print(1, SCREEN_WIDTH / StatusDisplay::CELL_WIDTH - signal.length(), signal.c_str());
   }
 
-  display.display();
+  statusDisplay.update();
 }
 
+// Members must fit DEVICE_STATE_JSON_SIZE in DeviceState.h
 void saveState(const JsonObject & json)
 {
   JsonObject device = json.createNestedObject("device");
   device["id"] = deviceName.c_str();
   device["millisOn"] = millisOn;
   device["millisOff"] = millisOff;
+  device["beamMode"] = beamMode;
+  device["pirMode"] = pirMode;
+  device["group"] = commandGroup;
 }
 
 void loadState(const JsonObject & json)
@@ -138,30 +347,21 @@ void loadState(const JsonObject & json)
     deviceName = json["device"]["id"].as<String>();
     millisOn = json["device"]["millisOn"].as<int>();
     millisOff = json["device"]["millisOff"].as<int>();
+    beamMode = json["device"]["beamMode"] | (int)Trigger::PULSE;
+    pirMode = json["device"]["pirMode"] | (int)Trigger::DISABLED;
+    // Groups are a byte on the wire, out of range keeps the current one
+    int group = json["device"]["group"] | 0;
+    if (group >= 0 && group <= 255)
+      commandGroup = group;
   }
+  framework_set_command_group(commandGroup);
+
+  trigger.setTiming(millisOn, millisOff);
+  trigger.setMode(BEAM_INPUT, (Trigger::Mode)beamMode);
+  trigger.setMode(PIR_INPUT, (Trigger::Mode)pirMode);
 }
 
 void loop() {
-  // put your main code here, to run repeatedly:
+  // Jobs are registered with the framework scheduler in setup().
   framework_loop();
-
-  if (digitalRead(BEAM_TRIGGER_PIN) == LOW) {
-    digitalWrite(RELAY_PIN, HIGH);
-    delay(millisOn);
-    digitalWrite(RELAY_PIN, LOW);
-    delay(millisOff);
-  }
-  
-  
-  // If the AP switch is closed, but wasn't closed at startup, restart to
-  // enter AP mode.
-  if (!startupRequestAP && digitalRead(forceAccessPointPin) == LOW) {
-    ESP.restart();
-  }
-
-  // If the AP switch is open, but was closed at startup, restart to exit
-  // AP mode
-  if (startupRequestAP && digitalRead(forceAccessPointPin) == HIGH) {
-    ESP.restart();
-  }
 }
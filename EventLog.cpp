@@ -0,0 +1,161 @@
+/*
+* EventLog.cpp
+*
+* Project: ESPixelStick - An ESP8266 and E1.31 based pixel driver
+* Copyright (c) 2016 Shelby Merrick
+* http://www.forkineye.com
+*
+*  This program is provided free for you to use in any way that you wish,
+*  subject to the laws and regulations where you are using it.  Due diligence
+*  is strongly suggested before using this code.  Please give credit where due.
+*
+*  The Author makes no warranty of any kind, express or implied, with regard
+*  to this program or the documentation contained in this document.  The
+*  Author shall not be liable in any event for incidental or consequential
+*  damages in connection with, or arising out of, the furnishing, performance
+*  or use of these programs.
+*
+*/
+
+#include "EventLog.h"
+
+#define EMPTY_SEQ   0xFFFFFFFF
+
+void EventLog::begin(FS &fs, const char *name, event_name_t names) {
+    _fs = &fs;
+    _name = name;
+    _names = names;
+
+    File file = _fs->open(_name, "r");
+    if (file && file.size() == FILE_RECORDS * sizeof(record_t)) {
+        /* Carry on after the newest record */
+        record_t record;
+        bool found = false;
+        uint32_t newest = 0;
+        uint32_t oldest = EMPTY_SEQ;
+        while (file.read(reinterpret_cast<uint8_t *>(&record), sizeof(record))
+                == sizeof(record)) {
+            if (record.seq == EMPTY_SEQ)
+                continue;
+            if (!found || (int32_t)(record.seq - newest) > 0)
+                newest = record.seq;
+            if (!found || (int32_t)(record.seq - oldest) < 0)
+                oldest = record.seq;
+            found = true;
+        }
+        file.close();
+
+        /* Called again after the file system was replaced, nothing to do */
+        if (found && (int32_t)(newest + 1 - _seq) > 0) {
+            _first = oldest;
+            _seq = _flushed = newest + 1;
+        }
+        return;
+    }
+    file.close();
+
+    /* New, empty log */
+    file = _fs->open(_name, "w");
+    if (!file)
+        return;
+    record_t empty;
+    memset(&empty, 0xFF, sizeof(empty));
+    for (uint16_t i = 0; i < FILE_RECORDS; i++)
+        file.write(reinterpret_cast<uint8_t *>(&empty), sizeof(empty));
+    file.close();
+}
+
+void ICACHE_RAM_ATTR EventLog::log(uint16_t type, uint16_t arg16, uint32_t arg) {
+    uint32_t savedPS = xt_rsil(15);
+
+    /* Full of unflushed records, lose the oldest */
+    if (_seq - _flushed >= RAM_RECORDS) {
+        _flushed++;
+        _lost++;
+    }
+
+    record_t *record = &_ring[_seq & (RAM_RECORDS - 1)];
+    record->seq = _seq;
+    record->time = millis();
+    record->type = type;
+    record->arg16 = arg16;
+    record->arg = arg;
+    _seq++;
+
+    xt_wsr_ps(savedPS);
+}
+
+void EventLog::flush() {
+    if (!_fs || _flushed == _seq)
+        return;
+
+    File file = _fs->open(_name, "r+");
+    if (!file)
+        return;
+
+    while (_flushed != _seq) {
+        record_t record;
+        uint32_t savedPS = xt_rsil(15);
+        uint32_t seq = _flushed;
+        record = _ring[seq & (RAM_RECORDS - 1)];
+        xt_wsr_ps(savedPS);
+
+        if (!file.seek((seq % FILE_RECORDS) * sizeof(record_t), SeekSet) ||
+                file.write(reinterpret_cast<uint8_t *>(&record), sizeof(record))
+                != sizeof(record))
+            break;
+
+        /* Only advance if the record wasn't lost while it was written */
+        savedPS = xt_rsil(15);
+        if (_flushed == seq)
+            _flushed++;
+        xt_wsr_ps(savedPS);
+    }
+    file.close();
+}
+
+/* Fetch one record, from RAM if it hasn't been written yet */
+bool EventLog::read(File &file, uint32_t seq, record_t &record) {
+    uint32_t savedPS = xt_rsil(15);
+    bool inRam = (int32_t)(seq - _flushed) >= 0 && (int32_t)(_seq - seq) > 0;
+    if (inRam)
+        record = _ring[seq & (RAM_RECORDS - 1)];
+    xt_wsr_ps(savedPS);
+    if (inRam)
+        return true;
+
+    return file && file.seek((seq % FILE_RECORDS) * sizeof(record_t), SeekSet) &&
+            file.read(reinterpret_cast<uint8_t *>(&record), sizeof(record))
+            == sizeof(record) && record.seq == seq;
+}
+
+size_t EventLog::readText(uint32_t seq, uint32_t end, size_t offset, uint8_t *buf,
+        size_t len) {
+    if (!_fs)
+        return 0;
+
+    File file = _fs->open(_name, "r");
+    size_t written = 0;
+    char line[LINE_LEN + 1];
+    while ((int32_t)(end - seq) > 0 && written < len && offset < LINE_LEN) {
+        record_t record;
+        if (read(file, seq, record)) {
+            const char *name = _names ? _names(record.type) : nullptr;
+            if (name)
+                snprintf(line, sizeof(line), "%10u %10u %-16.16s %5u %10u\n",
+                        record.seq, record.time, name, record.arg16, record.arg);
+            else
+                snprintf(line, sizeof(line), "%10u %10u %-16u %5u %10u\n",
+                        record.seq, record.time, record.type, record.arg16, record.arg);
+        } else {
+            snprintf(line, sizeof(line), "%10u %10s %-16s %5s %10s\n",
+                    seq, "-", "lost", "-", "-");
+        }
+        size_t part = min(LINE_LEN - offset, len - written);
+        memcpy(buf + written, line + offset, part);
+        written += part;
+        offset = 0;
+        seq++;
+    }
+    return written;
+}
@@ -0,0 +1,86 @@
+/*
+* EventLog.h
+*
+* Project: ESPixelStick - An ESP8266 and E1.31 based pixel driver
+* Copyright (c) 2016 Shelby Merrick
+* http://www.forkineye.com
+*
+*  This program is provided free for you to use in any way that you wish,
+*  subject to the laws and regulations where you are using it.  Due diligence
+*  is strongly suggested before using this code.  Please give credit where due.
+*
+*  The Author makes no warranty of any kind, express or implied, with regard
+*  to this program or the documentation contained in this document.  The
+*  Author shall not be liable in any event for incidental or consequential
+*  damages in connection with, or arising out of, the furnishing, performance
+*  or use of these programs.
+*
+*/
+
+#ifndef EVENTLOG_H_
+#define EVENTLOG_H_
+
+#include <Arduino.h>
+#include <FS.h>
+
+/* Binary event log.  log() only stores a fixed size record in a RAM ring,
+   with interrupts briefly masked, so it is cheap enough for any path
+   including ISRs.  flush() then writes the new records in a batch to a
+   fixed size file used as a ring, indexed by sequence number, so the file
+   never grows and the newest records survive a reboot.
+
+   readText() renders records as fixed width text lines straight into the
+   caller's buffer, so a chunked HTTP response can stream the whole log
+   without copying it anywhere first. */
+class EventLog {
+ public:
+    static const uint16_t RAM_RECORDS = 32;     /* Power of two */
+    static const uint16_t FILE_RECORDS = 256;
+    static const uint8_t LINE_LEN = 56;         /* readText() line length */
+
+    typedef const char * (*event_name_t)(uint16_t type);
+
+    typedef struct {
+        uint32_t    seq;
+        uint32_t    time;       /* millis() */
+        uint16_t    type;
+        uint16_t    arg16;
+        uint32_t    arg;
+    } record_t;
+
+    /* Open or create the log file and carry on its sequence numbers.  Call
+       again if the file system is replaced. */
+    void begin(FS &fs, const char *name, event_name_t names);
+
+    void log(uint16_t type, uint16_t arg16 = 0, uint32_t arg = 0);
+
+    /* Records waiting to be written */
+    uint16_t pending() { return _seq - _flushed; }
+    void flush();
+
+    /* Sequence numbers of the oldest record kept and the next to be logged */
+    uint32_t oldest() { return _seq > FILE_RECORDS ? _seq - FILE_RECORDS : _first; }
+    uint32_t next() { return _seq; }
+
+    /* Render records from seq up to end into buf, starting offset bytes
+       into the line for seq.  Lines that don't fit are cut off, carry on
+       from the same seq and offset.  Returns the bytes written. */
+    size_t readText(uint32_t seq, uint32_t end, size_t offset, uint8_t *buf,
+            size_t len);
+
+    uint32_t getLost() { return _lost; }
+
+ private:
+    bool read(File &file, uint32_t seq, record_t &record);
+
+    FS              *_fs = nullptr;
+    const char      *_name;
+    event_name_t    _names;
+    record_t        _ring[RAM_RECORDS];
+    uint32_t        _first = 0;         /* Oldest seq in a new file */
+    volatile uint32_t _seq = 0;         /* Next seq to log */
+    volatile uint32_t _flushed = 0;     /* Next seq to write to the file */
+    volatile uint32_t _lost = 0;        /* Overwritten before flushed */
+};
+
+#endif /* EVENTLOG_H_ */
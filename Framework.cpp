@@ -24,9 +24,19 @@
 #include <SPI.h>
 #include "Framework.h"
 #include "EFUpdate.h"
+#include "AssetHandler.h"
+#include "ConfigStore.h"
+#include "Metrics.h"
+#include "EventLog.h"
+#include "Discovery.h"
+#include "StateEvents.h"
+#include "CommandChannel.h"
 
 #include <Ticker.h>
 #include <ESP8266mDNS.h>
+#include <time.h>
+#include <sys/time.h>
+#include <coredecls.h>
 
 
 
@@ -35,10 +45,42 @@
 #define AP_TIMEOUT      60      /* In AP mode, wait 60 seconds for a connection or reboot */
 #define REBOOT_DELAY    100     /* Delay for rebooting once reboot flag is set */
 #define LOG_PORT        Serial  /* Serial port for console logging */
+#define TELEMETRY_INTERVAL  1000    /* Telemetry broadcast interval in ms */
+#define WS_MAX_CLIENTS      8       /* Max WS clients, more are turned away */
+#define WS_ACK_QUEUE        4       /* Queued acks per WS client */
+#define EVENT_FLUSH_INTERVAL 10000 /* Max ms events wait in RAM */
+#define TXT_UPTIME_INTERVAL 60      /* Uptime TXT record resolution in s */
+
+// Time source for scheduled actions. Point it at a server on the show
+// network to keep devices within a few ms of each other: a local server is
+// polled every 15 s, the SDK's minimum, so crystal drift (up to ~40 ppm)
+// stays under a ms between polls. The public pool is only polled every 15
+// minutes, which allows ~36 ms of drift.
+#if !defined(NTP_SERVER)
+#define NTP_SERVER      "pool.ntp.org"
+#define SNTP_INTERVAL   (15 * 60 * 1000)    /* SNTP poll interval in ms */
+#else
+#define SNTP_INTERVAL   15000
+#endif
+
+// JSON document sizes for the config and status layouts. The device state
+// is sized by the sketch, see DEVICE_STATE_JSON_SIZE in DeviceState.h.
+#define DEVICE_JSON_SIZE    (JSON_OBJECT_SIZE(1) + DEVICE_STATE_JSON_SIZE)
+#define CONFIG_JSON_SIZE    (JSON_OBJECT_SIZE(2) + JSON_OBJECT_SIZE(11) + \
+                             3 * JSON_ARRAY_SIZE(4) + DEVICE_STATE_JSON_SIZE)
+#define STATUS_JSON_SIZE    (JSON_OBJECT_SIZE(16) + JSON_OBJECT_SIZE(5) + \
+                             JSON_ARRAY_SIZE(MAX_TASKS) + \
+                             MAX_TASKS * JSON_OBJECT_SIZE(5) + 256)
 
 
 // Configuration file params
 #define CONFIG_MAX_SIZE 4096    /* Sanity limit for config file */
+#define CONFIG_UPLOAD_JSON_SIZE (1024 + DEVICE_STATE_JSON_SIZE)   /* Filtered config upload document */
+#define CONFIG_VERSION  1       /* Binary config record schema version */
+#define CONFIG_RECORD_MAX   512     /* Max binary config record size */
+#define CONFIG_LOG_SIZE     4096    /* Config log file size before switching */
+#define WIFI_CACHE_VERSION  1       /* WiFi cache record schema version */
+#define FAST_CONNECT_TIMEOUT    3000    /* ms to get an IP using the WiFi cache */
 
 
 const char VERSION[] = "3.2";
@@ -61,27 +103,181 @@ static void _u0_putc(char c) {
 //
 /////////////////////////////////////////////////////////
 
-// Configuration file
+// Legacy configuration file, imported once into the config store
 const char CONFIG_FILE[] = "/config.json";
 
+// Config uploads are spooled here before they're parsed
+const char CONFIG_UPLOAD_FILE[] = "/config.tmp";
+
+// DNS-SD service type other devices are discovered by
+const char DEVICE_SERVICE[] = "espixelstick";
+
+// Event log ring file
+const char EVENT_LOG_FILE[] = "/events.log";
+
+// Event names for /log
+const char * eventName(uint16_t type) {
+  switch (type) {
+    case EVENT_BOOT:            return "boot";
+    case EVENT_WIFI_CONNECT:    return "wifi_connect";
+    case EVENT_WIFI_DISCONNECT: return "wifi_disconnect";
+    case EVENT_AP_MODE:         return "ap_mode";
+    case EVENT_OTA_START:       return "ota_start";
+    case EVENT_OTA_END:         return "ota_end";
+    case EVENT_CONFIG_SAVE:     return "config_save";
+    case EVENT_TRIGGER:         return "trigger";
+    case EVENT_TIME_SYNC:       return "time_sync";
+    case EVENT_FS_ERROR:        return "fs_error";
+    case EVENT_CONFIG_LOAD:     return "config_load";
+    case EVENT_CONFIG_ERROR:    return "config_error";
+    case EVENT_CONFIG_UPLOAD:   return "config_upload";
+    case EVENT_OTA_RESUME_FAIL: return "ota_resume_fail";
+    case EVENT_WIFI_CACHE_FAIL: return "wifi_cache_fail";
+    case EVENT_WIFI_TIMEOUT:    return "wifi_timeout";
+    case EVENT_MDNS_ERROR:      return "mdns_error";
+    case EVENT_WIFI_OFF:        return "wifi_off";
+    case EVENT_WS_REJECT:       return "ws_reject";
+    case EVENT_WS_ERROR:        return "ws_error";
+    case EVENT_TASK_FULL:       return "task_full";
+    case EVENT_TASK_OVERRUN:    return "task_overrun";
+    case EVENT_UDP_CMD_ERROR:   return "udp_cmd_error";
+    default:                    return nullptr;
+  }
+}
+
+// Boot runs as a state machine from the loop, so the web server and user
+// code are up while WiFi associates
+enum BootState : uint8_t {
+  BOOT_START,         /* Pick station, AP or WiFi off */
+  BOOT_STAGGER,       /* Random delay before associating */
+  BOOT_ASSOCIATE,     /* Waiting for an IP, up to sta_timeout */
+  BOOT_FALLBACK,      /* Go SoftAP or reboot */
+  BOOT_RUNNING
+};
+
+// millis() at the end of each boot phase, reported in G2
+typedef struct {
+  uint32_t  fs;       /* File system and event log mounted */
+  uint32_t  config;   /* Config loaded */
+  uint32_t  web;      /* Web server listening */
+  uint32_t  loop;     /* First pass of the loop */
+  uint32_t  wifi;     /* Got an IP or started the AP */
+} boot_times_t;
+
+// Binary config record, followed by ssid, passphrase and hostname (each a
+// uint8_t length including the null, then the string) and a uint16_t length
+// and the device state from saveState() as MessagePack
+typedef struct {
+  uint8_t   flags;
+  uint8_t   ip[4];
+  uint8_t   netmask[4];
+  uint8_t   gateway[4];
+  uint32_t  sta_timeout;
+  uint32_t  ap_timeout;
+} __attribute__((packed)) config_record_t;
+
+#define CONFIG_FLAG_WIFI        0x01
+#define CONFIG_FLAG_DHCP        0x02
+#define CONFIG_FLAG_AP_FALLBACK 0x04
+
+// Last good association, used to skip the scan and DHCP on reconnect
+typedef struct {
+  char      ssid[33];   /* Network the rest applies to */
+  uint8_t   bssid[6];
+  uint8_t   channel;
+  uint32_t  ip;         /* DHCP lease, 0 when using a static IP */
+  uint32_t  gateway;
+  uint32_t  netmask;
+  uint32_t  dns;
+} __attribute__((packed)) wifi_cache_t;
+
 
 config_t            config;         // Current configuration
+uint32_t            configGeneration = 0;   // Bumped by every saveConfig()
 bool                reboot = false; // Reboot flag
 AsyncWebServer      web(HTTP_PORT); // Web Server
 AsyncWebSocket      ws("/ws");      // Web Socket Plugin
+StateEvents         stateEvents("/events");     // State change SSE stream
+AssetHandler        assets;         // Cached web assets
+ConfigStore         configStore(SPIFFS, "/config.a", "/config.b", CONFIG_LOG_SIZE);
+Metrics             metrics;        // Run-time counters, served at /metrics
+EventLog            eventLog;       // Event log, served at /log
+uint32_t            lastEventFlush = 0;
 WiFiEventHandler    wifiConnectHandler;     // WiFi connect handler
 WiFiEventHandler    wifiDisconnectHandler;  // WiFi disconnect handler
 Ticker              wifiTicker;     // Ticker to handle WiFi
+Ticker              fastConnectTicker;  // Falls back to a full scan
+ConfigStore         wifiStore(SPIFFS, "/wifi.a", "/wifi.b", 1024);
+wifi_cache_t        wifiCache;
+bool                wifiCacheValid = false;
+bool                wifiCacheDirty = false;
+bool                wifiFastConnect = false;    // Current attempt uses the cache
+bool                wifiCachedLease = false;    // ... and its DHCP lease
+bool                wifiDhcpRestart = false;    // Hand the lease back to DHCP
+uint32_t            wifiConnectStart = 0;
+BootState           bootState = BOOT_START;
+bool                bootForceAP = false;
+uint32_t            bootWait = 0;       // millis() the current boot phase began
+uint32_t            bootStagger = 0;
+boot_times_t        bootTimes = {};
+bool                mdnsPending = false;    // Start mDNS from the loop
+bool                mdnsRename = false;     // Hostname changed, re-announce
+bool                timeSynced = false;     // SNTP has set the clock
+void                (*timeSyncCallback)() = nullptr;
+Discovery           discovery(DEVICE_SERVICE, HTTP_PORT);   // mDNS, served at /peers
 
 
 connection_status_t connectionStatus;
 bool                updateDisplay = true;
-long                lastDisplayUpdate = 0;
+
+// Scheduler
+task_t              tasks[MAX_TASKS];
+int8_t              displayTask = -1;
+uint32_t            loopStart = 0;      // micros() the last pass started
+uint32_t            loopMax = 0;
+
+// Replies waiting for room in a WS client's send queue. Replies that are
+// built from current state (stats, config, status) are coalesced, so only
+// the latest of each is ever sent; acks are queued and the oldest dropped.
+// Either way a slow client costs a few bytes here, not queued messages.
+enum WsReply : uint8_t {
+  WS_REPLY_XJ, WS_REPLY_XJ_BIN,
+  WS_REPLY_G1, WS_REPLY_G1_BIN,
+  WS_REPLY_G2, WS_REPLY_G2_BIN
+};
+
+typedef struct {
+  uint32_t  id;                 // WS client id, 0 = free slot
+  uint8_t   pending;            // Coalesced replies, bit per WsReply
+  char      acks[WS_ACK_QUEUE][2];
+  uint8_t   ackHead;
+  uint8_t   ackCount;
+  bool      telemetry;          // Subscribed to telemetry
+} ws_outbox_t;
+
+ws_outbox_t         wsOutboxes[WS_MAX_CLIENTS];
 
 // Firmware update.
+AsyncWebServerRequest * fwUploadRequest = nullptr;
+bool fwUpdateDone = false;      // Upload finished and the image is good
+// Define EFU_PUBLIC_KEY as the uncompressed P-256 public key bytes printed by
+// "tools/efutool.py keygen" to accept only EFU images signed with its key.
+//#define EFU_PUBLIC_KEY { 0x04, ... }
 EFUpdate efupdate;
-uint8_t * WSframetemp;
-uint8_t * confuploadtemp;
+#if defined(EFU_PUBLIC_KEY)
+const uint8_t efuPublicKey[] = EFU_PUBLIC_KEY;
+#endif
+
+// Define UDP_CMD_KEY as the key bytes printed by "tools/udpcmd.py keygen" to
+// take relay commands over UDP on UDP_CMD_PORT and the multicast group.
+//#define UDP_CMD_KEY { 0x.., ... }
+#define UDP_CMD_PORT    5570
+const IPAddress UDP_CMD_MULTICAST(239, 255, 82, 67);
+CommandChannel commands;
+CommandChannel::command_fn_t commandCallback = nullptr;
+#if defined(UDP_CMD_KEY)
+const uint8_t udpCmdKey[] = UDP_CMD_KEY;
+#endif
 
 
 
@@ -96,14 +292,17 @@ void initWifi();
 void initWeb();
 void updateConfig();
 
-void serializeConfig(String &jsonString, bool pretty = false, bool creds = false);
+void buildConfig(JsonDocument &json, bool creds = false);
+size_t fillConfig(uint8_t *buffer, size_t maxLen, size_t index);
 void dsNetworkConfig(const JsonObject &json);
 void dsDeviceConfig(const JsonObject &json);
 void saveConfig();
 
 void connectWifi();
+void startAP();
 void onWifiConnect(const WiFiEventStationModeGotIP &event);
 void onWiFiDisconnect(const WiFiEventStationModeDisconnected &event);
+void onTimeSync();
 void idleTimeout();
 
 void wsEvent(AsyncWebSocket *server, AsyncWebSocketClient *client,
@@ -113,6 +312,8 @@ void handle_fw_upload(AsyncWebServerRequest *request, String filename,
 void handle_config_upload(AsyncWebServerRequest *request, String filename,
                           size_t index, uint8_t *data, size_t len, bool final);
 void displayStatus();
+void initTasks();
+void wsQueueAckAll(const char *ack);
 
 
 // Radio config
@@ -152,22 +353,23 @@ AsyncWebServer * framework_setup(bool forceAccessPoint) {
   LOG_PORT.println(")");
   LOG_PORT.println(ESP.getFullVersion());
 
-  // Enable SPIFFS
-  if (!SPIFFS.begin())
-  {
-    LOG_PORT.println("File system did not initialise correctly");
-  }
-  else
-  {
-    LOG_PORT.println("File system initialised");
-  }
+  // Enable SPIFFS. Diagnostics from here on go to the event log, /log.
+  bool fsMounted = SPIFFS.begin();
+
+  // Event log, starting with why we booted
+  eventLog.begin(SPIFFS, EVENT_LOG_FILE, eventName);
+  eventLog.log(EVENT_BOOT, ESP.getResetInfoPtr()->reason, ESP.getResetInfoPtr()->exccause);
+  if (!fsMounted)
+    eventLog.log(EVENT_FS_ERROR, 0);
 
   FSInfo fs_info;
   if (SPIFFS.info(fs_info))
   {
+#if defined(LIST_FILES)
     LOG_PORT.print("Total bytes in file system: ");
     LOG_PORT.println(fs_info.usedBytes);
 
+    // Opens every file, slow on a full file system
     Dir dir = SPIFFS.openDir("/");
     while (dir.next()) {
       LOG_PORT.print(dir.fileName());
@@ -175,11 +377,13 @@ AsyncWebServer * framework_setup(bool forceAccessPoint) {
       File f = dir.openFile("r");
       LOG_PORT.println(f.size());
     }
+#endif
   }
   else
   {
-    LOG_PORT.println("Failed to read file system details");
+    eventLog.log(EVENT_FS_ERROR, 1);
   }
+  bootTimes.fs = millis();
 
   // Load configuration from SPIFFS and set Hostname
   loadConfig();
@@ -188,62 +392,41 @@ AsyncWebServer * framework_setup(bool forceAccessPoint) {
     LOG_PORT.println(config.hostname);
     WiFi.hostname(config.hostname);
   }
+  bootTimes.config = millis();
 
   connectionStatus.status = CONNSTAT_NONE;
 
-  if (forceAccessPoint) {
-    LOG_PORT.println("Forced access point switch is ON.");
-  }
-  else {
-    LOG_PORT.println("Forced access point switch is OFF.");
-  }
-
-  // Setup WiFi Handlers
+  // Setup WiFi Handlers. WiFi itself is brought up by bootTask.
   wifiConnectHandler = WiFi.onStationModeGotIP(onWifiConnect);
+  bootForceAP = forceAccessPoint;
+  settimeofday_cb(onTimeSync);
 
-  if (!config.useWifi && !forceAccessPoint) {
-    LOG_PORT.println(F("WiFi disabled."));
-    WiFi.mode(WIFI_OFF);
-  }
-  else {
-    if (!forceAccessPoint && config.useWifi) {
-      initWifi();
-    }
-
-    // If we fail, go SoftAP or reboot
-    if (WiFi.status() != WL_CONNECTED) {
-      if (forceAccessPoint || (config.useWifi && config.ap_fallback)) {
-        LOG_PORT.println(F("*** FAILED TO ASSOCIATE WITH AP, GOING SOFTAP ***"));
-        WiFi.mode(WIFI_AP);
-        connectionStatus.ssid = config.hostname;
-        WiFi.softAP(connectionStatus.ssid.c_str());
-        connectionStatus.ourLocalIP = WiFi.softAPIP();
-        connectionStatus.ourSubnetMask = IPAddress(255, 255, 255, 0);
-        connectionStatus.status = CONNSTAT_LOCALAP;
-        updateDisplay = true;
-      } else if (config.useWifi) {
-        LOG_PORT.println(F("*** FAILED TO ASSOCIATE WITH AP, REBOOTING ***"));
-        ESP.restart();
-      }
-    }
+  initTasks();
 
-    wifiDisconnectHandler = WiFi.onStationModeDisconnected(onWiFiDisconnect);
+  // Configure and start the web server, it listens on whatever interface
+  // comes up later
+  initWeb();
+  bootTimes.web = millis();
 
-    LOG_PORT.print("IP : ");
-    LOG_PORT.println(connectionStatus.ourLocalIP);
-    LOG_PORT.print("Subnet mask : ");
-    LOG_PORT.println(connectionStatus.ourSubnetMask);
-  }
+  return &web;
+}
 
-  // Configure and start the web server
-  if (connectionStatus.status == CONNSTAT_CONNECTED || connectionStatus.status == CONNSTAT_LOCALAP) {
-    initWeb();
-    return &web;
-  }
-  else {
-    return NULL;
-  }
+// Go SoftAP, named after our hostname
+void startAP() {
+  eventLog.log(EVENT_AP_MODE, bootForceAP);
+  WiFi.mode(WIFI_AP);
+  connectionStatus.ssid = config.hostname;
+  WiFi.softAP(connectionStatus.ssid.c_str());
+  connectionStatus.ourLocalIP = WiFi.softAPIP();
+  connectionStatus.ourSubnetMask = IPAddress(255, 255, 255, 0);
+  connectionStatus.status = CONNSTAT_LOCALAP;
+  updateDisplay = true;
+  bootTimes.wifi = millis();
 
+  LOG_PORT.print("IP : ");
+  LOG_PORT.println(connectionStatus.ourLocalIP);
+  LOG_PORT.print("Subnet mask : ");
+  LOG_PORT.println(connectionStatus.ourSubnetMask);
 }
 
 /////////////////////////////////////////////////////////
@@ -253,31 +436,40 @@ AsyncWebServer * framework_setup(bool forceAccessPoint) {
 /////////////////////////////////////////////////////////
 
 void initWifi() {
-  // Switch to station mode and disconnect just in case
+  // Switch to station mode and disconnect just in case. The SDK doesn't need
+  // to persist the station config, we keep our own cache. bootTask then
+  // calls connectWifi().
+  WiFi.persistent(false);
   WiFi.mode(WIFI_STA);
   WiFi.disconnect();
 
   if (config.ssid.length() == 0)
     return;
 
+  uint16_t version;
+  size_t len;
+  wifiCacheValid = wifiStore.load(reinterpret_cast<uint8_t *>(&wifiCache),
+                                  sizeof(wifiCache), version, len) &&
+                   version == WIFI_CACHE_VERSION && len == sizeof(wifiCache) &&
+                   config.ssid == wifiCache.ssid;
+}
+
+// Cached association didn't get an IP in time, forget it and scan
+void fastConnectFailed() {
+  if (!wifiFastConnect || connectionStatus.status == CONNSTAT_CONNECTED)
+    return;
+
+  eventLog.log(EVENT_WIFI_CACHE_FAIL);
+  wifiCacheValid = false;
+  WiFi.disconnect();
+  WiFi.config(0u, 0u, 0u);
   connectWifi();
-  uint32_t timeout = millis();
-  while (WiFi.status() != WL_CONNECTED) {
-    LOG_PORT.print(".");
-    delay(500);
-    if (millis() - timeout > (1000 * config.sta_timeout) ) {
-      LOG_PORT.println("");
-      LOG_PORT.println(F("*** Failed to connect ***"));
-      connectionStatus.status = CONNSTAT_NONE;
-      updateDisplay = true;
-      displayStatus();
-      break;
-    }
-  }
 }
 
 void connectWifi() {
-  delay(secureRandom(100, 500));
+  // Use the cached BSSID, channel and lease to skip the scan and DHCP.
+  // Otherwise stagger so a room full of devices doesn't hit the AP at once.
+  wifiFastConnect = wifiCacheValid;
 
   LOG_PORT.println("");
   LOG_PORT.print(F("Connecting to "));
@@ -287,10 +479,22 @@ void connectWifi() {
   connectionStatus.status = CONNSTAT_CONNECTING;
   connectionStatus.ssid = config.ssid;
   updateDisplay = true;
-  displayStatus();
 
-  WiFi.begin(config.ssid.c_str(), config.passphrase.c_str());
-  if (config.dhcp) {
+  wifiConnectStart = millis();
+  if (wifiFastConnect) {
+    WiFi.begin(config.ssid.c_str(), config.passphrase.c_str(),
+               wifiCache.channel, wifiCache.bssid);
+    fastConnectTicker.once_ms(FAST_CONNECT_TIMEOUT, fastConnectFailed);
+  } else {
+    WiFi.begin(config.ssid.c_str(), config.passphrase.c_str());
+  }
+
+  wifiCachedLease = config.dhcp && wifiFastConnect && wifiCache.ip;
+  if (wifiCachedLease) {
+    // Reuse the last lease, DHCP is restarted once we're associated
+    WiFi.config(wifiCache.ip, wifiCache.gateway, wifiCache.netmask, wifiCache.dns);
+    LOG_PORT.print(F("Connecting with cached lease"));
+  } else if (config.dhcp) {
     LOG_PORT.print(F("Connecting with DHCP"));
   } else {
     // We don't use DNS, so just set it to our gateway
@@ -304,8 +508,11 @@ void connectWifi() {
 }
 
 void onWifiConnect(const WiFiEventStationModeGotIP &event) {
+  // Already up on a cached lease, this is DHCP taking over from it
+  bool renewed = connectionStatus.status == CONNSTAT_CONNECTED;
+
   LOG_PORT.println("");
-  LOG_PORT.print(F("Connected with IP: "));
+  LOG_PORT.print(renewed ? F("DHCP lease for IP: ") : F("Connected with IP: "));
   LOG_PORT.println(WiFi.localIP());
 
   connectionStatus.ourLocalIP = WiFi.localIP();
@@ -313,24 +520,76 @@ void onWifiConnect(const WiFiEventStationModeGotIP &event) {
   connectionStatus.status = CONNSTAT_CONNECTED;
   updateDisplay = true;
 
-  // Setup mDNS / DNS-SD
-  //TODO: Reboot or restart mdns when config.id is changed?
-  String chipId = String(ESP.getChipId(), HEX);
-  MDNS.setInstanceName(String(config.hostname + " (" + chipId + ")").c_str());
-  if (MDNS.begin(config.hostname.c_str())) {
-    MDNS.addService("http", "tcp", HTTP_PORT);
-  } else {
-    LOG_PORT.println(F("*** Error setting up mDNS responder ***"));
+  if (!renewed) {
+    connectionStatus.timeToIP = millis() - wifiConnectStart;
+    connectionStatus.fastConnect = wifiFastConnect;
+    if (!bootTimes.wifi)
+      bootTimes.wifi = millis();
+
+    eventLog.log(EVENT_WIFI_CONNECT, wifiFastConnect, connectionStatus.timeToIP);
   }
+
+  // A cached lease is a static IP as far as the SDK is concerned and would
+  // never be renewed. Restart DHCP so the server renews it, or hands out a
+  // new address if it expired while we were off.
+  if (wifiCachedLease) {
+    wifiCachedLease = false;
+    wifiDhcpRestart = true;
+  }
+
+  // Remember this association, saved from the loop rather than this callback
+  fastConnectTicker.detach();
+  wifi_cache_t cache = {};
+  strncpy(cache.ssid, config.ssid.c_str(), sizeof(cache.ssid) - 1);
+  memcpy(cache.bssid, WiFi.BSSID(), sizeof(cache.bssid));
+  cache.channel = WiFi.channel();
+  if (config.dhcp) {
+    cache.ip = WiFi.localIP();
+    cache.gateway = WiFi.gatewayIP();
+    cache.netmask = WiFi.subnetMask();
+    cache.dns = WiFi.dnsIP();
+  }
+  wifiCache = cache;
+  wifiCacheValid = true;
+  wifiCacheDirty = true;
+
+  // mDNS is started from bootTask, not this callback. It follows later
+  // reconnects by itself.
+  mdnsPending = !discovery.isStarted();
+}
+
+// mDNS instance name, the hostname and our chip id
+String mdnsInstance() {
+  return config.hostname + " (" + String(ESP.getChipId(), HEX) + ")";
+}
+
+// Setup mDNS / DNS-SD
+void startMdns() {
+  char version[sizeof(VERSION)];
+  strcpy_P(version, VERSION);
+  discovery.setTxt("version", version);
+  discovery.setTxt("id", String(ESP.getChipId(), HEX).c_str());
+  discovery.setTxt("uptime", millis() / 1000);
+
+  if (!discovery.begin(config.hostname.c_str(), mdnsInstance().c_str()))
+    eventLog.log(EVENT_MDNS_ERROR);
 }
 
 void onWiFiDisconnect(const WiFiEventStationModeDisconnected &event) {
-  LOG_PORT.println(F("*** WiFi Disconnected ***"));
+  eventLog.log(EVENT_WIFI_DISCONNECT, event.reason);
+
+  // Cached association was rejected, scan next time
+  if (connectionStatus.status != CONNSTAT_CONNECTED && wifiFastConnect) {
+    fastConnectTicker.detach();
+    wifiCacheValid = false;
+    WiFi.config(0u, 0u, 0u);
+  }
 
   connectionStatus.status = CONNSTAT_NONE;
   updateDisplay = true;
 
-  wifiTicker.once(2, connectWifi);
+  // Stagger so a room full of devices doesn't hit the AP at once
+  wifiTicker.once_ms(2000 + secureRandom(100, 500), connectWifi);
 }
 
 
@@ -341,32 +600,96 @@ void onWiFiDisconnect(const WiFiEventStationModeDisconnected &event) {
 //
 /////////////////////////////////////////////////////////
 
+// Wrap a request handler to record how long it takes
+ArRequestHandlerFunction timed(const char *name, ArRequestHandlerFunction handler) {
+  int8_t id = metrics.addHandler(name);
+  return [id, handler](AsyncWebServerRequest * request) {
+    uint32_t start = micros();
+    handler(request);
+    metrics.request(id, micros() - start);
+  };
+}
+
 // Configure and start the web server
 void initWeb() {
   // Handle OTA update from asynchronous callbacks
   Update.runAsync(true);
+#if defined(EFU_PUBLIC_KEY)
+  efupdate.setPublicKey(efuPublicKey, sizeof(efuPublicKey));
+#endif
 
   // Setup WebSockets
   ws.onEvent(wsEvent);
   web.addHandler(&ws);
 
+  // Server-Sent Events for state changes
+  stateEvents.begin(web);
+
   // Heap status handler
-  web.on("/heap", HTTP_GET, [](AsyncWebServerRequest * request) {
+  web.on("/heap", HTTP_GET, timed("/heap", [](AsyncWebServerRequest * request) {
     request->send(200, "text/plain", String(ESP.getFreeHeap()));
-  });
+  }));
+
+  // Prometheus metrics handler
+  web.on("/metrics", HTTP_GET, timed("/metrics", [](AsyncWebServerRequest * request) {
+    AsyncResponseStream *response = request->beginResponseStream("text/plain; version=0.0.4");
+    metrics.write(*response);
+    if (commands.isStarted())
+      commands.write(*response);
+    request->send(response);
+  }));
+
+  // Event log, streamed from flash as fixed width text lines
+  web.on("/log", HTTP_GET, timed("/log", [](AsyncWebServerRequest * request) {
+    uint32_t first = eventLog.oldest();
+    uint32_t end = eventLog.next();
+    request->send(request->beginChunkedResponse("text/plain",
+        [first, end](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+          return eventLog.readText(first + index / EventLog::LINE_LEN, end,
+                                   index % EventLog::LINE_LEN, buffer, maxLen);
+        }));
+  }));
+
+  // Other devices heard over mDNS
+  web.on("/peers", HTTP_GET, timed("/peers", [](AsyncWebServerRequest * request) {
+    AsyncResponseStream *response = request->beginResponseStream("application/json");
+    discovery.write(*response);
+    request->send(response);
+  }));
+
+  // JSON Config Handler. Each chunk is generated again from the live config,
+  // so a config saved while it's going out would splice two versions
+  // together; the connection is dropped instead, so the client sees a
+  // truncated response rather than a complete but invalid one.
+  web.on("/conf", HTTP_GET, timed("/conf", [](AsyncWebServerRequest * request) {
+    uint32_t generation = configGeneration;
+    request->send(request->beginChunkedResponse("text/json",
+        [request, generation](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+          // Closed on the next poll, not from under this callback
+          if (configGeneration != generation) {
+            request->client()->close();
+            return RESPONSE_TRY_AGAIN;
+          }
+          return fillConfig(buffer, maxLen, index);
+        }));
+  }));
 
-  // JSON Config Handler
-  web.on("/conf", HTTP_GET, [](AsyncWebServerRequest * request) {
-    String jsonString;
-    serializeConfig(jsonString, true);
-    request->send(200, "text/json", jsonString);
-  });
+  // Firmware upload progress, where an interrupted upload resumes from
+  web.on("/updatefw", HTTP_GET, timed("/updatefw", [](AsyncWebServerRequest * request) {
+    request->send(200, "text/plain", String(efupdate.getOffset()));
+  })).setFilter(ON_STA_FILTER);
 
   // Firmware upload handler - only in station mode
   web.on("/updatefw", HTTP_POST, [](AsyncWebServerRequest * request) {
-    ws.textAll("X6");
+    // Not for a rejected resume or a failed update, we're not rebooting
+    if (request == fwUploadRequest && fwUpdateDone)
+      wsQueueAckAll("X6");
   }, handle_fw_upload).setFilter(ON_STA_FILTER);
 
+  // Manifest listed assets, with ETags and caching, ahead of the static handler
+  if (assets.begin(SPIFFS, "/www/"))
+    web.addHandler(&assets);
+
   // Static Handler
   web.serveStatic("/", SPIFFS, "/www/").setDefaultFile("index.html");
 
@@ -381,7 +704,7 @@ void initWeb() {
 
   // Config file upload handler - only in station mode
   web.on("/config", HTTP_POST, [](AsyncWebServerRequest * request) {
-    ws.textAll("X6");
+    wsQueueAckAll("X6");
   }, handle_config_upload).setFilter(ON_STA_FILTER);
 
   web.begin();
@@ -408,6 +731,8 @@ void updateConfig() {
 
 // De-Serialize Network config
 void dsNetworkConfig(const JsonObject &json) {
+  String hostname = config.hostname;
+
   if (json.containsKey("network")) {
     JsonObject networkJson = json["network"];
 
@@ -438,12 +763,16 @@ void dsNetworkConfig(const JsonObject &json) {
     config.hostname = networkJson["hostname"].as<String>();
   }
   else {
-    LOG_PORT.println("No network settings found.");
+    eventLog.log(EVENT_CONFIG_ERROR, CONFIG_ERR_NO_NETWORK);
   }
 
   if (!config.hostname.length()) {
     config.hostname = "esp-" + String(ESP.getChipId(), HEX);
   }
+
+  // Advertise the new name without a reboot
+  if (config.hostname != hostname)
+    mdnsRename = true;
 }
 
 
@@ -452,55 +781,193 @@ void dsDeviceConfig(const JsonObject &json) {
   loadState(json);
 }
 
-// Load configugration JSON file
+// Print into a fixed size buffer, without a terminating null
+class BufferPrint : public Print {
+ public:
+  BufferPrint(uint8_t *buffer, size_t size) : _p(buffer), _left(size) {}
+
+  size_t write(uint8_t c) override {
+    if (!_left)
+      return 0;
+    *_p++ = c;
+    _left--;
+    return 1;
+  }
+
+ private:
+  uint8_t *_p;
+  size_t  _left;
+};
+
+// Print the window [skip, skip + size) of its output into a buffer, so a
+// document can be sent in chunks by serializing it again for each one
+class ChunkPrint : public Print {
+ public:
+  ChunkPrint(uint8_t *buffer, size_t size, size_t skip)
+      : _p(buffer), _left(size), _skip(skip), _written(0) {}
+
+  size_t write(uint8_t c) override {
+    if (_skip) {
+      _skip--;
+      return 1;
+    }
+    if (!_left)
+      return 0;
+    *_p++ = c;
+    _left--;
+    _written++;
+    return 1;
+  }
+
+  size_t written() { return _written; }
+
+ private:
+  uint8_t *_p;
+  size_t  _left;
+  size_t  _skip;
+  size_t  _written;
+};
+
+// Pack the current config into a binary config record
+size_t packConfig(uint8_t *buf, size_t size) {
+  config_record_t *record = reinterpret_cast<config_record_t *>(buf);
+  record->flags = (config.useWifi ? CONFIG_FLAG_WIFI : 0) |
+                  (config.dhcp ? CONFIG_FLAG_DHCP : 0) |
+                  (config.ap_fallback ? CONFIG_FLAG_AP_FALLBACK : 0);
+  memcpy(record->ip, config.ip, 4);
+  memcpy(record->netmask, config.netmask, 4);
+  memcpy(record->gateway, config.gateway, 4);
+  record->sta_timeout = config.sta_timeout;
+  record->ap_timeout = config.ap_timeout;
+
+  size_t pos = sizeof(config_record_t);
+  const String *strings[] = { &config.ssid, &config.passphrase, &config.hostname };
+  for (const String *str : strings) {
+    size_t len = str->length() + 1;
+    if (len > 0xFF || pos + 1 + len > size)
+      return 0;
+    buf[pos++] = len;
+    memcpy(buf + pos, str->c_str(), len);
+    pos += len;
+  }
+
+  StaticJsonDocument<DEVICE_JSON_SIZE> json;
+  saveState(json.to<JsonObject>());
+  if (json.overflowed()) {
+    eventLog.log(EVENT_CONFIG_ERROR, CONFIG_ERR_STATE_SIZE);
+    return 0;
+  }
+  size_t len = measureMsgPack(json);
+  if (pos + 2 + len > size)
+    return 0;
+  buf[pos++] = len;
+  buf[pos++] = len >> 8;
+  BufferPrint print(buf + pos, len);
+  serializeMsgPack(json, print);
+
+  return pos + len;
+}
+
+// Unpack a binary config record into the current config
+bool unpackConfig(uint8_t *buf, size_t size) {
+  if (size < sizeof(config_record_t))
+    return false;
+
+  config_record_t *record = reinterpret_cast<config_record_t *>(buf);
+  config.useWifi = record->flags & CONFIG_FLAG_WIFI;
+  config.dhcp = record->flags & CONFIG_FLAG_DHCP;
+  config.ap_fallback = record->flags & CONFIG_FLAG_AP_FALLBACK;
+  memcpy(config.ip, record->ip, 4);
+  memcpy(config.netmask, record->netmask, 4);
+  memcpy(config.gateway, record->gateway, 4);
+  config.sta_timeout = record->sta_timeout;
+  config.ap_timeout = record->ap_timeout;
+
+  size_t pos = sizeof(config_record_t);
+  String *strings[] = { &config.ssid, &config.passphrase, &config.hostname };
+  for (String *str : strings) {
+    if (pos >= size)
+      return false;
+    size_t len = buf[pos++];
+    if (!len || pos + len > size || buf[pos + len - 1])
+      return false;
+    *str = reinterpret_cast<char *>(buf + pos);
+    pos += len;
+  }
+
+  if (pos + 2 > size)
+    return false;
+  size_t len = buf[pos] | buf[pos + 1] << 8;
+  pos += 2;
+  if (pos + len > size)
+    return false;
+
+  // Parse in place, the device strings are copied out by loadState()
+  StaticJsonDocument<DEVICE_JSON_SIZE> json;
+  if (deserializeMsgPack(json, reinterpret_cast<char *>(buf + pos), len))
+    return false;
+  dsDeviceConfig(json.as<JsonObject>());
+
+  return true;
+}
+
+// Import a legacy configuration JSON file
+bool importConfig(File &file) {
+  size_t size = file.size();
+  if (size > CONFIG_MAX_SIZE) {
+    eventLog.log(EVENT_CONFIG_ERROR, CONFIG_ERR_TOO_LARGE, size);
+    return false;
+  }
+
+  std::unique_ptr<char[]> buf(new char[size]);
+  file.readBytes(buf.get(), size);
+
+  DynamicJsonDocument json(CONFIG_UPLOAD_JSON_SIZE);
+  DeserializationError error = deserializeJson(json, buf.get(), size);
+  if (error) {
+    eventLog.log(EVENT_CONFIG_ERROR, CONFIG_ERR_PARSE, size);
+    return false;
+  }
+
+  dsNetworkConfig(json.as<JsonObject>());
+  dsDeviceConfig(json.as<JsonObject>());
+  return true;
+}
+
+// Load configuration from the config store
 void loadConfig() {
   // Zeroize Config struct
   memset(&config, 0, sizeof(config));
 
-  // Load CONFIG_FILE json. Create and init with defaults if not found
-  File file = SPIFFS.open(CONFIG_FILE, "r");
-  if (!file) {
-    LOG_PORT.println(F("- No configuration file found."));
+  uint8_t record[CONFIG_RECORD_MAX];
+  uint16_t version;
+  size_t len;
+  File file;
+  if (configStore.load(record, sizeof(record), version, len) &&
+      version == CONFIG_VERSION && unpackConfig(record, len)) {
+    eventLog.log(EVENT_CONFIG_LOAD, CONFIG_FROM_STORE, len);
+  } else if ((file = SPIFFS.open(CONFIG_FILE, "r")) && importConfig(file)) {
+    // Move it into the config store, JSON stays an import / export format
+    file.close();
+    saveConfig();
+    SPIFFS.remove(CONFIG_FILE);
+    eventLog.log(EVENT_CONFIG_LOAD, CONFIG_IMPORTED);
+  } else {
+    eventLog.log(EVENT_CONFIG_LOAD, CONFIG_DEFAULTS);
     config.ssid = "";
     config.passphrase = "";
     config.hostname = "esps-" + String(ESP.getChipId(), HEX);
     config.ap_fallback = true;
     config.useWifi = true;
     saveConfig();
-  } else {
-    // Parse CONFIG_FILE json
-    size_t size = file.size();
-    if (size > CONFIG_MAX_SIZE) {
-      LOG_PORT.println(F("*** Configuration File too large ***"));
-      return;
-    }
-
-    std::unique_ptr<char[]> buf(new char[size]);
-    file.readBytes(buf.get(), size);
-
-    DynamicJsonDocument json(1024);
-    DeserializationError error = deserializeJson(json, buf.get());
-    if (error) {
-      LOG_PORT.println(F("*** Configuration File Format Error ***"));
-      return;
-    }
-
-    dsNetworkConfig(json.as<JsonObject>());
-    dsDeviceConfig(json.as<JsonObject>());
-
-
-    LOG_PORT.println(F("- Configuration loaded."));
   }
 
   // Validate it
   validateConfig();
 }
 
-// Serialize the current config into a JSON string
-void serializeConfig(String &jsonString, bool pretty, bool creds) {
-  // Create buffer and root object
-  DynamicJsonDocument json(1024);
-
+// Build the current config into a JSON document
+void buildConfig(JsonDocument &json, bool creds) {
   // Network
   JsonObject network = json.createNestedObject("network");
   network["useWifi"] = config.useWifi;
@@ -524,32 +991,36 @@ void serializeConfig(String &jsonString, bool pretty, bool creds) {
 
   // Device
   saveState(json.as<JsonObject>());
+  if (json.overflowed())
+    eventLog.log(EVENT_CONFIG_ERROR, CONFIG_ERR_STATE_SIZE);
+}
 
+// Chunked response filler for /conf, the pretty JSON config without
+// credentials. Only the fixed size document and one chunk are held at a
+// time; nothing is kept between chunks.
+size_t fillConfig(uint8_t *buffer, size_t maxLen, size_t index) {
+  StaticJsonDocument<CONFIG_JSON_SIZE> json;
+  buildConfig(json);
 
-  if (pretty)
-    serializeJsonPretty(json, jsonString);
-  else
-    serializeJson(json, jsonString);
+  ChunkPrint print(buffer, maxLen, index);
+  serializeJsonPretty(json, print);
+  return print.written();
 }
 
 
-// Save configuration JSON file
+// Save configuration to the config store
 void saveConfig() {
   // Update Config
   updateConfig();
-
-  // Serialize Config
-  String jsonString;
-  serializeConfig(jsonString, true, true);
+  configGeneration++;
 
   // Save Config
-  File file = SPIFFS.open(CONFIG_FILE, "w");
-  if (!file) {
-    LOG_PORT.println(F("*** Error creating configuration file ***"));
-    return;
+  uint8_t record[CONFIG_RECORD_MAX];
+  size_t len = packConfig(record, sizeof(record));
+  if (!len || !configStore.save(CONFIG_VERSION, record, len)) {
+    eventLog.log(EVENT_CONFIG_ERROR, CONFIG_ERR_SAVE, len);
   } else {
-    file.println(jsonString);
-    LOG_PORT.println(F("* Configuration saved."));
+    eventLog.log(EVENT_CONFIG_SAVE, 0, len);
   }
 }
 
@@ -584,15 +1055,139 @@ void displayStatus()
 
     XJ - Get RSSI,heap,uptime, e131 stats in json
 
+    XS - Subscribe to telemetry, XS0 to unsubscribe
+
     X6 - Reboot
+
+  Subscribed clients get a binary XJ frame every TELEMETRY_INTERVAL, built once
+  and shared by all of them. Clients whose send queue is full skip a tick.
+
+  Replies wait in a per-client outbox until the client's send queue has room,
+  see ws_outbox_t. Acks go out straight away when there's room; XJ, G1 and G2
+  are built and sent from the loop by the wsflush task. Up to WS_MAX_CLIENTS clients are served, later ones are
+  closed with 1013. The library's own per-client queue depth can be lowered
+  with -DWS_MAX_QUEUED_MESSAGES.
+
+  XJ, G1 and G2 sent as a binary frame are answered with a binary frame of
+  the same two byte command followed by:
+    XJ - wsstats_t
+    G1 - Config as MessagePack
+    G2 - Config status as MessagePack
 */
 
+// Binary XJ reply, little endian
+typedef struct {
+  char      cmd[2];
+  int32_t   rssi;
+  uint32_t  freeheap;
+  uint32_t  uptime;
+  uint32_t  maxblock;   /* Largest free heap block */
+  uint32_t  minheap;    /* Lowest free heap seen */
+  uint8_t   frag;       /* Heap fragmentation % */
+} __attribute__((packed)) wsstats_t;
+
+// Build the network / system status
+void buildStatus(JsonDocument &json) {
+  json["ssid"] = WiFi.SSID();
+  json["hostname"] = WiFi.hostname();
+  json["ip"] = WiFi.localIP().toString();
+  json["mac"] = WiFi.macAddress();
+  json["version"] = VERSION;
+  json["built"] = BUILD_DATE;
+  json["flashchipid"] = String(ESP.getFlashChipId(), HEX);
+  json["usedflashsize"] = ESP.getFlashChipSize();
+  json["realflashsize"] = ESP.getFlashChipRealSize();
+  json["freeheap"] = ESP.getFreeHeap();
+  json["timetoip"] = connectionStatus.timeToIP;
+  json["fastconnect"] = connectionStatus.fastConnect;
+  json["loopmax"] = loopMax;
+  json["timesync"] = timeSynced;
+
+  JsonObject boot = json.createNestedObject("boot");
+  boot["fs"] = bootTimes.fs;
+  boot["config"] = bootTimes.config;
+  boot["web"] = bootTimes.web;
+  boot["loop"] = bootTimes.loop;
+  boot["wifi"] = bootTimes.wifi;
+
+  JsonArray taskStats = json.createNestedArray("tasks");
+  for (uint8_t i = 0; i < MAX_TASKS; i++) {
+    if (!tasks[i].used)
+      continue;
+    JsonObject task = taskStats.createNestedObject();
+    task["id"] = i;     /* As in task_overrun events */
+    task["name"] = tasks[i].name;
+    task["runs"] = tasks[i].runs;
+    task["max"] = tasks[i].maxMicros;
+    task["overruns"] = tasks[i].overruns;
+  }
+}
 
-// Handle request that start with 'X'
-void procX(uint8_t *data, AsyncWebSocketClient *client) {
-  switch (data[1]) {
-    case 'J': {
+// Send cmd followed by json as MessagePack, encoded straight into the
+// outgoing WS buffer
+void sendMsgPack(AsyncWebSocketClient *client, const char *cmd, const JsonDocument &json) {
+  size_t len = measureMsgPack(json);
+  AsyncWebSocketMessageBuffer *buffer = ws.makeBuffer(len + 2);
+  if (!buffer)
+    return;
+
+  uint8_t *out = buffer->get();
+  out[0] = cmd[0];
+  out[1] = cmd[1];
+  BufferPrint print(out + 2, len);
+  serializeMsgPack(json, print);
+  client->binary(buffer);
+  metrics.wsSent(len + 2);
+}
+
+// Send cmd followed by json as a text frame, encoded straight into the
+// outgoing WS buffer
+void sendJson(AsyncWebSocketClient *client, const char *cmd, const JsonDocument &json) {
+  size_t len = measureJson(json);
+  AsyncWebSocketMessageBuffer *buffer = ws.makeBuffer(len + 2);
+  if (!buffer)
+    return;
+
+  uint8_t *out = buffer->get();
+  out[0] = cmd[0];
+  out[1] = cmd[1];
+  BufferPrint print(out + 2, len);
+  serializeJson(json, print);
+  client->text(buffer);
+  metrics.wsSent(len + 2);
+}
+
+// Build a binary XJ frame
+AsyncWebSocketMessageBuffer * makeStats() {
+  AsyncWebSocketMessageBuffer *buffer = ws.makeBuffer(sizeof(wsstats_t));
+  if (!buffer)
+    return nullptr;
+
+  wsstats_t *stats = reinterpret_cast<wsstats_t *>(buffer->get());
+  stats->cmd[0] = 'X';
+  stats->cmd[1] = 'J';
+  stats->rssi = WiFi.RSSI();
+  stats->freeheap = ESP.getFreeHeap();
+  stats->uptime = millis();
+  stats->maxblock = ESP.getMaxFreeBlockSize();
+  stats->minheap = metrics.getMinFreeHeap();
+  stats->frag = ESP.getHeapFragmentation();
+  return buffer;
+}
 
+// Send a binary XJ frame to one client
+void sendStats(AsyncWebSocketClient *client) {
+  AsyncWebSocketMessageBuffer *buffer = makeStats();
+  if (buffer) {
+    client->binary(buffer);
+    metrics.wsSent(sizeof(wsstats_t));
+  }
+}
+
+// Build and send a reply
+void sendReply(AsyncWebSocketClient *client, uint8_t reply) {
+  switch (reply) {
+    case WS_REPLY_XJ: {
         DynamicJsonDocument json(1024);
 
         // system statistics
@@ -601,9 +1196,189 @@ void procX(uint8_t *data, AsyncWebSocketClient *client) {
         system["freeheap"] = (String)ESP.getFreeHeap();
         system["uptime"] = (String)millis();
 
-        String response;
-        serializeJson(json, response);
-        client->text("XJ" + response);
+        sendJson(client, "XJ", json);
+        break;
+      }
+
+    case WS_REPLY_XJ_BIN:
+      sendStats(client);
+      break;
+
+    case WS_REPLY_G1:
+    case WS_REPLY_G1_BIN: {
+        StaticJsonDocument<CONFIG_JSON_SIZE> json;
+        buildConfig(json, true);
+        if (reply == WS_REPLY_G1)
+          sendJson(client, "G1", json);
+        else
+          sendMsgPack(client, "G1", json);
+        break;
+      }
+
+    case WS_REPLY_G2:
+    case WS_REPLY_G2_BIN: {
+        StaticJsonDocument<STATUS_JSON_SIZE> json;
+        buildStatus(json);
+        if (reply == WS_REPLY_G2)
+          sendJson(client, "G2", json);
+        else
+          sendMsgPack(client, "G2", json);
+        break;
+      }
+  }
+}
+
+ws_outbox_t * findOutbox(uint32_t id) {
+  for (uint8_t i = 0; i < WS_MAX_CLIENTS; i++) {
+    if (wsOutboxes[i].id == id)
+      return &wsOutboxes[i];
+  }
+  return nullptr;
+}
+
+// Send what the client has room for. Returns false once the client is gone.
+// Replies build JSON documents on the stack, so they're only sent with
+// replies set, from the loop; wsEvent() runs on the much smaller sys stack
+// and only sends acks.
+bool wsFlush(ws_outbox_t *outbox, bool replies) {
+  AsyncWebSocketClient *client = ws.client(outbox->id);
+  if (!client) {
+    outbox->id = 0;
+    return false;
+  }
+
+  while (client->status() == WS_CONNECTED && !client->queueIsFull()) {
+    if (outbox->ackCount) {
+      client->text(outbox->acks[outbox->ackHead], 2);
+      metrics.wsSent(2);
+      outbox->ackHead = (outbox->ackHead + 1) % WS_ACK_QUEUE;
+      outbox->ackCount--;
+    } else if (replies && outbox->pending) {
+      uint8_t reply = __builtin_ctz(outbox->pending);
+      outbox->pending &= ~(1 << reply);
+      sendReply(client, reply);
+    } else {
+      break;
+    }
+  }
+  return true;
+}
+
+// Flush all outboxes, run from the scheduler
+void wsFlushAll() {
+  for (uint8_t i = 0; i < WS_MAX_CLIENTS; i++) {
+    if (wsOutboxes[i].id && (wsOutboxes[i].pending || wsOutboxes[i].ackCount))
+      wsFlush(&wsOutboxes[i], true);
+  }
+}
+
+// Queue a reply, replacing one of the same kind that hasn't gone yet. It's
+// built and sent by the wsflush task.
+void wsQueueReply(AsyncWebSocketClient *client, uint8_t reply) {
+  ws_outbox_t *outbox = findOutbox(client->id());
+  if (!outbox)
+    return;
+
+  if (outbox->pending & (1 << reply))
+    metrics.wsDropped();
+  outbox->pending |= 1 << reply;
+}
+
+// Queue a two character ack, dropping the oldest if there's no room
+void wsQueueAck(ws_outbox_t *outbox, const char *ack) {
+  if (outbox->ackCount == WS_ACK_QUEUE) {
+    outbox->ackHead = (outbox->ackHead + 1) % WS_ACK_QUEUE;
+    outbox->ackCount--;
+    metrics.wsDropped();
+  }
+
+  char *slot = outbox->acks[(outbox->ackHead + outbox->ackCount) % WS_ACK_QUEUE];
+  slot[0] = ack[0];
+  slot[1] = ack[1];
+  outbox->ackCount++;
+  wsFlush(outbox, false);
+}
+
+void wsQueueAck(AsyncWebSocketClient *client, const char *ack) {
+  ws_outbox_t *outbox = findOutbox(client->id());
+  if (outbox)
+    wsQueueAck(outbox, ack);
+}
+
+void wsQueueAckAll(const char *ack) {
+  for (uint8_t i = 0; i < WS_MAX_CLIENTS; i++) {
+    if (wsOutboxes[i].id)
+      wsQueueAck(&wsOutboxes[i], ack);
+  }
+}
+
+// Add or remove a client from the telemetry subscribers
+void subscribeTelemetry(uint32_t id, bool subscribe) {
+  ws_outbox_t *outbox = findOutbox(id);
+  if (outbox)
+    outbox->telemetry = subscribe;
+}
+
+// Broadcast one telemetry frame to all subscribers
+void sendTelemetry() {
+  AsyncWebSocketMessageBuffer *buffer = nullptr;
+
+  for (uint8_t i = 0; i < WS_MAX_CLIENTS; i++) {
+    if (!wsOutboxes[i].id || !wsOutboxes[i].telemetry)
+      continue;
+
+    AsyncWebSocketClient *client = ws.client(wsOutboxes[i].id);
+    if (!client) {
+      wsOutboxes[i].id = 0;
+      continue;
+    }
+
+    // Slow client, skip this tick rather than queue behind it
+    if (client->queueIsFull()) {
+      metrics.wsDropped();
+      continue;
+    }
+
+    if (!buffer) {
+      buffer = makeStats();
+      if (!buffer)
+        return;
+      buffer->lock();
+    }
+    client->binary(buffer);
+    metrics.wsSent(sizeof(wsstats_t));
+  }
+
+  if (buffer) {
+    buffer->unlock();
+    ws._cleanBuffers();
+  }
+}
+
+// Handle binary requests
+void procBinary(uint8_t *data, AsyncWebSocketClient *client) {
+  if (data[0] == 'X' && data[1] == 'J') {
+    wsQueueReply(client, WS_REPLY_XJ_BIN);
+  } else if (data[0] == 'G' && data[1] == '1') {
+    wsQueueReply(client, WS_REPLY_G1_BIN);
+  } else if (data[0] == 'G' && data[1] == '2') {
+    wsQueueReply(client, WS_REPLY_G2_BIN);
+  }
+}
+
+
+// Handle request that start with 'X'
+void procX(uint8_t *data, AsyncWebSocketClient *client) {
+  switch (data[1]) {
+    case 'J':
+      wsQueueReply(client, WS_REPLY_XJ);
+      break;
+
+    case 'S': {
+        bool subscribe = data[2] != '0';
+        subscribeTelemetry(client->id(), subscribe);
+        if (subscribe)
+          wsQueueReply(client, WS_REPLY_XJ_BIN);
         break;
       }
 
@@ -615,33 +1390,13 @@ void procX(uint8_t *data, AsyncWebSocketClient *client) {
 // Handle requests that start with 'G'
 void procG(uint8_t *data, AsyncWebSocketClient *client) {
   switch (data[1]) {
-    case '1': {
-        String response;
-        serializeConfig(response, false, true);
-        client->text("G1" + response);
-        break;
-      }
-
-    case '2': {
-        // Create buffer and root object
-        DynamicJsonDocument json(1024);
+    case '1':
+      wsQueueReply(client, WS_REPLY_G1);
+      break;
 
-        json["ssid"] = (String)WiFi.SSID();
-        json["hostname"] = (String)WiFi.hostname();
-        json["ip"] = WiFi.localIP().toString();
-        json["mac"] = WiFi.macAddress();
-        json["version"] = (String)VERSION;
-        json["built"] = (String)BUILD_DATE;
-        json["flashchipid"] = String(ESP.getFlashChipId(), HEX);
-        json["usedflashsize"] = (String)ESP.getFlashChipSize();
-        json["realflashsize"] = (String)ESP.getFlashChipRealSize();
-        json["freeheap"] = (String)ESP.getFreeHeap();
-
-        String response;
-        serializeJson(json, response);
-        client->text("G2" + response);
-        break;
-      }
+    case '2':
+      wsQueueReply(client, WS_REPLY_G2);
+      break;
 
   }
 }
@@ -653,8 +1408,7 @@ void procS(uint8_t *data, AsyncWebSocketClient *client) {
   DeserializationError error = deserializeJson(json, reinterpret_cast<char*>(data + 2));
 
   if (error) {
-    LOG_PORT.println(F("*** procS(): Parse Error ***"));
-    LOG_PORT.println(reinterpret_cast<char*>(data));
+    eventLog.log(EVENT_CONFIG_ERROR, CONFIG_ERR_PARSE);
     return;
   }
 
@@ -663,7 +1417,7 @@ void procS(uint8_t *data, AsyncWebSocketClient *client) {
     case '1':   // Set Network Config
       dsNetworkConfig(json.as<JsonObject>());
       saveConfig();
-      client->text("S1");
+      wsQueueAck(client, "S1");
       break;
     case '2':   // Set Device Config
 
@@ -671,9 +1425,9 @@ void procS(uint8_t *data, AsyncWebSocketClient *client) {
       saveConfig();
 
       if (reboot)
-        client->text("S1");
+        wsQueueAck(client, "S1");
       else
-        client->text("S2");
+        wsQueueAck(client, "S2");
       break;
   }
 }
@@ -683,24 +1437,44 @@ void handle_fw_upload(AsyncWebServerRequest *request, String filename,
                       size_t index, uint8_t *data, size_t len, bool final) {
   if (!index) {
     WiFiUDP::stopAll();
-    LOG_PORT.print(F("* Upload Started: "));
-    LOG_PORT.println(filename.c_str());
-    efupdate.begin();
-  }
 
-  if (!efupdate.process(data, len)) {
-    LOG_PORT.print(F("*** UPDATE ERROR: "));
-    LOG_PORT.println(String(efupdate.getError()));
+    // An upload cut off mid-way can be continued by posting the rest of
+    // the file with ?offset= set to what GET /updatefw reports.
+    uint32_t offset = 0;
+    if (request->hasParam("offset"))
+      offset = request->getParam("offset")->value().toInt();
+
+    fwUploadRequest = nullptr;
+    fwUpdateDone = false;
+    if (!offset) {
+      efupdate.begin();
+    } else if (!efupdate.resume(offset)) {
+      eventLog.log(EVENT_OTA_RESUME_FAIL, 0, offset);
+      request->send(409, "text/plain", String(efupdate.getOffset()));
+      return;
+    }
+    fwUploadRequest = request;
+    metrics.otaStart();
+    eventLog.log(EVENT_OTA_START, 0, offset);
   }
 
+  // Only the request that started or resumed the update feeds it
+  if (request != fwUploadRequest)
+    return;
+
+  metrics.otaData(len);
+  efupdate.process(data, len);
+
   if (efupdate.hasError())
     request->send(200, "text/plain", "Update Error: " +
                   String(efupdate.getError()));
 
   if (final) {
-    LOG_PORT.println(F("* Upload Finished."));
-    efupdate.end();
+    metrics.otaEnd();
+    fwUpdateDone = efupdate.end();
     SPIFFS.begin();
+    eventLog.begin(SPIFFS, EVENT_LOG_FILE, eventName);
+    eventLog.log(EVENT_OTA_END, efupdate.getError(), index + len);
     saveConfig();
     reboot = true;
   }
@@ -708,34 +1482,57 @@ void handle_fw_upload(AsyncWebServerRequest *request, String filename,
 
 void handle_config_upload(AsyncWebServerRequest *request, String filename,
                           size_t index, uint8_t *data, size_t len, bool final) {
+  // The upload is spooled to SPIFFS and parsed from there, so no part of it
+  // needs to be held in RAM at once
   static File file;
+  static bool rejected;
+
   if (!index) {
     WiFiUDP::stopAll();
-    LOG_PORT.print(F("* Config Upload Started: "));
-    LOG_PORT.println(filename.c_str());
 
-    if (confuploadtemp) {
-      free (confuploadtemp);
-      confuploadtemp = nullptr;
+    rejected = false;
+    if (file)
+      file.close();
+    file = SPIFFS.open(CONFIG_UPLOAD_FILE, "w");
+    if (!file) {
+      eventLog.log(EVENT_CONFIG_ERROR, CONFIG_ERR_UPLOAD_FILE);
+      request->send(500, "text/plain", "Config Update Error." );
+      rejected = true;
     }
-    confuploadtemp = (uint8_t*) malloc(CONFIG_MAX_SIZE);
   }
 
-  LOG_PORT.printf("index %d len %d\n", index, len);
-  memcpy(confuploadtemp + index, data, len);
-  confuploadtemp[index + len] = 0;
+  if (rejected)
+    return;
+
+  if (index + len > CONFIG_MAX_SIZE) {
+    eventLog.log(EVENT_CONFIG_ERROR, CONFIG_ERR_TOO_LARGE, index + len);
+    file.close();
+    SPIFFS.remove(CONFIG_UPLOAD_FILE);
+    request->send(413, "text/plain", "Config Update Error: too large." );
+    rejected = true;
+    return;
+  }
+
+  file.write(data, len);
 
   if (final) {
-    int filesize = index + len;
-    LOG_PORT.print(F("* Config Upload Finished:"));
-    LOG_PORT.printf(" %d bytes", filesize);
+    eventLog.log(EVENT_CONFIG_UPLOAD, 0, index + len);
+    file.close();
 
-    DynamicJsonDocument json(1024);
-    DeserializationError error = deserializeJson(json, reinterpret_cast<char*>(confuploadtemp));
+    // Only keep what dsNetworkConfig() and dsDeviceConfig() read
+    StaticJsonDocument<64> filter;
+    filter["network"] = true;
+    filter["device"] = true;
+
+    file = SPIFFS.open(CONFIG_UPLOAD_FILE, "r");
+    DynamicJsonDocument json(CONFIG_UPLOAD_JSON_SIZE);
+    DeserializationError error = deserializeJson(json, file,
+                                                 DeserializationOption::Filter(filter));
+    file.close();
+    SPIFFS.remove(CONFIG_UPLOAD_FILE);
 
     if (error) {
-      LOG_PORT.println(F("*** Parse Error ***"));
-      LOG_PORT.println(reinterpret_cast<char*>(confuploadtemp));
+      eventLog.log(EVENT_CONFIG_ERROR, CONFIG_ERR_PARSE, index + len);
       request->send(500, "text/plain", "Config Update Error." );
     } else {
       dsNetworkConfig(json.as<JsonObject>());
@@ -744,11 +1541,6 @@ void handle_config_upload(AsyncWebServerRequest *request, String filename,
       request->send(200, "text/plain", "Config Update Finished: " );
       //          reboot = true;
     }
-
-    if (confuploadtemp) {
-      free (confuploadtemp);
-      confuploadtemp = nullptr;
-    }
   }
 }
 
@@ -757,6 +1549,7 @@ void wsEvent(AsyncWebSocket *server, AsyncWebSocketClient *client,
   switch (type) {
     case WS_EVT_DATA: {
         AwsFrameInfo *info = static_cast<AwsFrameInfo*>(arg);
+        metrics.wsReceived(len);
         if (info->opcode == WS_TEXT) {
           switch (data[0]) {
             case 'X':
@@ -769,24 +1562,33 @@ void wsEvent(AsyncWebSocket *server, AsyncWebSocketClient *client,
               procS(data, client);
               break;
           }
-        } else {
-          LOG_PORT.println(F("-- binary message --"));
+        } else if (info->index == 0 && len >= 2) {
+          procBinary(data, client);
         }
         break;
       }
-    case WS_EVT_CONNECT:
-      LOG_PORT.print(F("* WS Connect - "));
-      LOG_PORT.println(client->id());
-      break;
-    case WS_EVT_DISCONNECT:
-      LOG_PORT.print(F("* WS Disconnect - "));
-      LOG_PORT.println(client->id());
-      break;
-    case WS_EVT_PONG:
-      LOG_PORT.println(F("* WS PONG *"));
-      break;
+    case WS_EVT_CONNECT: {
+        ws_outbox_t *outbox = findOutbox(0);
+        if (!outbox) {
+          eventLog.log(EVENT_WS_REJECT);
+          metrics.wsRejected();
+          client->close(1013, "Too many clients");
+          break;
+        }
+        memset(outbox, 0, sizeof(ws_outbox_t));
+        outbox->id = client->id();
+        break;
+      }
+    case WS_EVT_DISCONNECT: {
+        ws_outbox_t *outbox = findOutbox(client->id());
+        if (outbox)
+          outbox->id = 0;
+        break;
+      }
     case WS_EVT_ERROR:
-      LOG_PORT.println(F("** WS ERROR **"));
+      eventLog.log(EVENT_WS_ERROR, client->id());
+      break;
+    default:
       break;
   }
 }
@@ -798,21 +1600,308 @@ void wsEvent(AsyncWebSocket *server, AsyncWebSocketClient *client,
 //  Main Loop
 //
 /////////////////////////////////////////////////////////
-void framework_loop() {
-  // Reboot handler
+/////////////////////////////////////////////////////////
+//
+//  Scheduler Section
+//
+/////////////////////////////////////////////////////////
+
+int8_t addTask(const char *name, task_callback_t callback, uint32_t interval,
+               uint32_t delay, uint8_t priority, uint32_t budget, bool oneShot) {
+  for (int8_t i = 0; i < MAX_TASKS; i++) {
+    if (tasks[i].used)
+      continue;
+
+    task_t *task = &tasks[i];
+    memset(task, 0, sizeof(task_t));
+    task->name = name;
+    task->callback = callback;
+    task->interval = interval;
+    task->due = millis() + delay;
+    task->budget = budget;
+    task->priority = priority;
+    task->oneShot = oneShot;
+    task->used = true;
+    return i;
+  }
+
+  eventLog.log(EVENT_TASK_FULL);
+  return -1;
+}
+
+int8_t framework_add_task(const char *name, task_callback_t callback,
+                          uint32_t interval, uint8_t priority, uint32_t budget) {
+  return addTask(name, callback, interval, 0, priority, budget, false);
+}
+
+int8_t framework_add_oneshot(const char *name, task_callback_t callback,
+                             uint32_t delay, uint8_t priority, uint32_t budget) {
+  return addTask(name, callback, 0, delay, priority, budget, true);
+}
+
+void framework_remove_task(int8_t id) {
+  if (id >= 0 && id < MAX_TASKS)
+    tasks[id].used = false;
+}
+
+void framework_wake_task(int8_t id) {
+  if (id >= 0 && id < MAX_TASKS)
+    tasks[id].due = millis();
+}
+
+const task_t * framework_tasks() {
+  return tasks;
+}
+
+uint32_t framework_loop_max() {
+  return loopMax;
+}
+
+// Run one task and account for its time
+void runTask(task_t *task) {
+  uint32_t start = micros();
+  if (task->oneShot)
+    task->used = false;
+  else
+    task->due = millis() + task->interval;
+
+  task->callback();
+
+  uint32_t elapsed = micros() - start;
+  task->runs++;
+  if (elapsed > task->maxMicros)
+    task->maxMicros = elapsed;
+  if (task->budget && elapsed > task->budget) {
+    if (!task->overruns++)
+      eventLog.log(EVENT_TASK_OVERRUN, task - tasks, elapsed);
+  }
+}
+
+// Framework tasks
+void rebootTask() {
   if (reboot) {
+    eventLog.flush();
     delay(REBOOT_DELAY);
     ESP.restart();
   }
+}
 
-  if (updateDisplay || millis() > lastDisplayUpdate + 2000) {
-    displayStatus();
-    updateDisplay = false;
-    lastDisplayUpdate = millis();
+void wifiCacheTask() {
+  if (wifiDhcpRestart) {
+    wifiDhcpRestart = false;
+    WiFi.config(0u, 0u, 0u);
+  }
+
+  if (wifiCacheDirty) {
+    wifiCacheDirty = false;
+    wifiStore.save(WIFI_CACHE_VERSION, reinterpret_cast<uint8_t *>(&wifiCache),
+                   sizeof(wifiCache));
   }
+}
+
+// Poll SNTP more often than the default hour, so clocks don't drift apart
+uint32_t sntp_update_delay_MS_rfc_not_less_than_15000() {
+  return SNTP_INTERVAL;
+}
+
+// Called each time SNTP sets the clock
+void onTimeSync() {
+  if (!timeSynced)
+    eventLog.log(EVENT_TIME_SYNC);
+  timeSynced = true;
 
+  // The clock may have stepped under anything already scheduled
+  if (timeSyncCallback)
+    timeSyncCallback();
+}
+
+void framework_on_time_sync(void (*callback)()) {
+  timeSyncCallback = callback;
+}
+
+bool framework_time(uint64_t &ms) {
+  if (!timeSynced)
+    return false;
+
+  struct timeval tv;
+  gettimeofday(&tv, nullptr);
+  ms = (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+  return true;
+}
+
+// Bring up WiFi without blocking the loop
+void bootTask() {
+  switch (bootState) {
+    case BOOT_START:
+      if (bootForceAP) {
+        startAP();
+        bootState = BOOT_RUNNING;
+      } else if (!config.useWifi) {
+        eventLog.log(EVENT_WIFI_OFF);
+        WiFi.mode(WIFI_OFF);
+        bootState = BOOT_RUNNING;
+      } else {
+        initWifi();
+        configTime(0, 0, NTP_SERVER);
+        if (config.ssid.length() == 0) {
+          bootState = BOOT_FALLBACK;
+        } else {
+          // Stagger so a room full of devices doesn't hit the AP at once,
+          // no need when going straight to a cached BSSID
+          bootStagger = wifiCacheValid ? 0 : secureRandom(100, 500);
+          bootWait = millis();
+          bootState = BOOT_STAGGER;
+        }
+      }
+      break;
+
+    case BOOT_STAGGER:
+      if (millis() - bootWait >= bootStagger) {
+        connectWifi();
+        bootWait = millis();
+        bootState = BOOT_ASSOCIATE;
+      }
+      break;
+
+    case BOOT_ASSOCIATE:
+      if (connectionStatus.status == CONNSTAT_CONNECTED) {
+        wifiDisconnectHandler = WiFi.onStationModeDisconnected(onWiFiDisconnect);
+        bootState = BOOT_RUNNING;
+      } else if (millis() - bootWait > 1000 * config.sta_timeout) {
+        eventLog.log(EVENT_WIFI_TIMEOUT);
+        fastConnectTicker.detach();
+        connectionStatus.status = CONNSTAT_NONE;
+        updateDisplay = true;
+        bootState = BOOT_FALLBACK;
+      }
+      break;
+
+    case BOOT_FALLBACK:
+      // Either shows in the log, as ap_mode or the reason for the next boot
+      if (config.ap_fallback)
+        startAP();
+      else
+        reboot = true;
+      bootState = BOOT_RUNNING;
+      break;
+
+    case BOOT_RUNNING:
+      if (mdnsPending) {
+        mdnsPending = false;
+        startMdns();
+      }
+      if (mdnsRename) {
+        mdnsRename = false;
+        discovery.setHostname(config.hostname.c_str(), mdnsInstance().c_str());
+      }
+      discovery.update();
+
+#if defined(UDP_CMD_KEY)
+      // Once there's an interface to join the group on
+      if (commandCallback && !commands.isStarted() &&
+          (connectionStatus.status == CONNSTAT_CONNECTED ||
+           connectionStatus.status == CONNSTAT_LOCALAP)) {
+        commands.setKey(udpCmdKey, sizeof(udpCmdKey));
+        if (!commands.begin(UDP_CMD_PORT, UDP_CMD_MULTICAST, commandCallback, framework_time)) {
+          eventLog.log(EVENT_UDP_CMD_ERROR);
+          commandCallback = nullptr;
+        }
+      }
+#endif
+      break;
+  }
+}
+
+// Keep the uptime TXT record current, to the minute so it isn't announced
+// every second
+void uptimeTxtTask() {
+  uint32_t uptime = millis() / 1000;
+  discovery.setTxt("uptime", uptime - uptime % TXT_UPTIME_INTERVAL);
+}
+
+void framework_publish_event(const char *name, const char *data) {
+  stateEvents.publish(name, data);
+}
+
+void flushEventsTask() {
+  stateEvents.flush();
+}
+
+void framework_on_command(bool (*callback)(uint8_t command, uint32_t arg)) {
+  commandCallback = callback;
+}
+
+void framework_set_command_group(uint8_t group) {
+  commands.setGroup(group);
+}
+
+void framework_set_service_txt(const char *key, const char *value) {
+  discovery.setTxt(key, value);
+}
+
+// Write events out in batches, sooner if the RAM ring is filling up
+void eventLogTask() {
+  if (eventLog.pending() >= EventLog::RAM_RECORDS / 2 ||
+      (eventLog.pending() && millis() - lastEventFlush >= EVENT_FLUSH_INTERVAL)) {
+    eventLog.flush();
+    lastEventFlush = millis();
+  }
+}
+
+void ICACHE_RAM_ATTR framework_log_event(uint16_t type, uint16_t arg16, uint32_t arg) {
+  eventLog.log(type, arg16, arg);
+}
+
+void serialTask() {
   // workaround crash - consume incoming bytes on serial port
   if (LOG_PORT.available()) {
     while (LOG_PORT.read() >= 0);
   }
 }
+
+void initTasks() {
+  framework_add_task("reboot", rebootTask, 0, TASK_PRIORITY_HIGH);
+  displayTask = framework_add_task("display", displayStatus, 2000, TASK_PRIORITY_LOW, 20000);
+  framework_add_task("telemetry", sendTelemetry, TELEMETRY_INTERVAL, TASK_PRIORITY_NORMAL, 2000);
+  framework_add_task("wsflush", wsFlushAll, 0, TASK_PRIORITY_NORMAL, 5000);
+  framework_add_task("events", flushEventsTask, 50, TASK_PRIORITY_NORMAL, 5000);
+  framework_add_task("boot", bootTask, 10, TASK_PRIORITY_NORMAL);
+  framework_add_task("wificache", wifiCacheTask, 1000, TASK_PRIORITY_LOW);
+  framework_add_task("eventlog", eventLogTask, 1000, TASK_PRIORITY_LOW);
+  framework_add_task("uptimetxt", uptimeTxtTask, 1000 * TXT_UPTIME_INTERVAL, TASK_PRIORITY_LOW);
+  framework_add_task("serial", serialTask, 0, TASK_PRIORITY_LOW);
+}
+
+void framework_loop() {
+  uint32_t start = micros();
+  if (!bootTimes.loop)
+    bootTimes.loop = millis();
+  if (loopStart) {
+    uint32_t elapsed = start - loopStart;
+    if (elapsed > loopMax)
+      loopMax = elapsed;
+    metrics.loopPass(elapsed);
+  }
+  loopStart = start;
+  metrics.sampleHeap();
+
+  if (updateDisplay) {
+    updateDisplay = false;
+    framework_wake_task(displayTask);
+  }
+
+  for (uint8_t priority = TASK_PRIORITY_HIGH; priority <= TASK_PRIORITY_LOW; priority++) {
+    for (uint8_t i = 0; i < MAX_TASKS; i++) {
+      task_t *task = &tasks[i];
+      if (!task->used || task->priority != priority ||
+          (int32_t)(millis() - task->due) < 0)
+        continue;
+
+      // Over budget for this pass, leave the rest for the next one
+      if (priority != TASK_PRIORITY_HIGH && micros() - start > SCHED_PASS_BUDGET)
+        return;
+
+      runTask(task);
+    }
+  }
+}
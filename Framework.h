@@ -25,6 +25,7 @@
 #include <ESPAsyncUDP.h>
 #include <ESPAsyncWebServer.h>
 #include <ArduinoJson.h>
+#include "DeviceState.h"
 
 // Configuration structure
 typedef struct {
@@ -52,6 +53,8 @@ typedef struct {
   IPAddress             ourLocalIP;
   IPAddress             ourSubnetMask;
   int                   signalStrength;
+  uint32_t              timeToIP;       /* ms from connect to got IP */
+  bool                  fastConnect;    /* Connected using the WiFi cache */
 } connection_status_t;
 
 // Implemented by user code.
@@ -62,14 +65,127 @@ extern void updateStatus(const connection_status_t & connectionStatus);
 // Save/load status data to flash memory and web interface.
 void saveState(const JsonObject & jsonObject);
 void loadState(const JsonObject & jsonObject);
+// saveState() is sized by DEVICE_STATE_JSON_SIZE in DeviceState.h
 
 // Implemented by framework.
 
-// Setup the framework.
+// Setup the framework. Returns as soon as the web server is listening,
+// WiFi comes up from framework_loop().
 extern AsyncWebServer * framework_setup(bool forceAccessPoint);
 
 // Called from loop.
 extern void framework_loop();
 
+// Event log -- kept in flash and served at /log.
+enum EventType {
+  EVENT_BOOT = 1,         /* arg16 reset reason, arg exception cause */
+  EVENT_WIFI_CONNECT,     /* arg16 1 if from the WiFi cache, arg ms to IP */
+  EVENT_WIFI_DISCONNECT,  /* arg16 reason */
+  EVENT_AP_MODE,          /* arg16 1 if forced by the switch */
+  EVENT_OTA_START,        /* arg resume offset */
+  EVENT_OTA_END,          /* arg16 EFUpdate error, arg bytes received */
+  EVENT_CONFIG_SAVE,      /* arg record size */
+  EVENT_TRIGGER,          /* arg16 Trigger input, arg latency us */
+  EVENT_TIME_SYNC,        /* First SNTP sync */
+  EVENT_FS_ERROR,         /* arg16 0 mount failed, 1 no file system info */
+  EVENT_CONFIG_LOAD,      /* arg16 ConfigSource */
+  EVENT_CONFIG_ERROR,     /* arg16 ConfigError, arg size where known */
+  EVENT_CONFIG_UPLOAD,    /* arg bytes */
+  EVENT_OTA_RESUME_FAIL,  /* arg offset asked for */
+  EVENT_WIFI_CACHE_FAIL,  /* Cached association got no IP, scanning */
+  EVENT_WIFI_TIMEOUT,     /* No IP within sta_timeout */
+  EVENT_MDNS_ERROR,
+  EVENT_WIFI_OFF,         /* WiFi disabled in the config */
+  EVENT_WS_REJECT,        /* Too many websocket clients */
+  EVENT_WS_ERROR,         /* arg16 client id */
+  EVENT_TASK_FULL,        /* Task table full */
+  EVENT_TASK_OVERRUN,     /* arg16 task id, arg us. First overrun only */
+  EVENT_UDP_CMD_ERROR,    /* UDP command channel didn't start */
+  EVENT_USER = 0x100      /* First free for user code */
+};
+
+enum ConfigSource { CONFIG_FROM_STORE, CONFIG_IMPORTED, CONFIG_DEFAULTS };
+
+enum ConfigError {
+  CONFIG_ERR_TOO_LARGE = 1,
+  CONFIG_ERR_PARSE,       /* File, upload or websocket JSON */
+  CONFIG_ERR_NO_NETWORK,  /* No network settings, defaults used */
+  CONFIG_ERR_STATE_SIZE,  /* Device state doesn't fit DEVICE_STATE_JSON_SIZE */
+  CONFIG_ERR_SAVE,
+  CONFIG_ERR_UPLOAD_FILE  /* Couldn't spool an upload */
+};
+
+// Log an event. Cheap and safe from anywhere, including ISRs.
+extern void framework_log_event(uint16_t type, uint16_t arg16 = 0, uint32_t arg = 0);
+
+// Set a TXT record on the device's mDNS service, e.g. its state for other
+// devices' /peers. Only announced when the value changes.
+extern void framework_set_service_txt(const char *key, const char *value);
+
+// Push a state change to /events clients. name must be a string literal.
+// Changes to the same name within ~50 ms are coalesced into one event.
+extern void framework_publish_event(const char *name, const char *data);
+
+// Wall clock in ms since the epoch, kept in step across devices by SNTP.
+// Returns false until the first sync.
+extern bool framework_time(uint64_t &ms);
+
+// Called each time SNTP sets the clock, the first sync included. Anything
+// timed against framework_time() should work out its timers again.
+extern void framework_on_time_sync(void (*callback)());
+
+// Relay commands over authenticated UDP, see CommandChannel. Only active
+// when built with UDP_CMD_KEY. The callback runs straight from the UDP
+// receive callback and returns false for a command it doesn't know.
+// Devices only take multicast commands for group 0 (all) or their group,
+// and none until framework_time() is synced.
+extern void framework_on_command(bool (*callback)(uint8_t command, uint32_t arg));
+extern void framework_set_command_group(uint8_t group);
+
+// Scheduler -- tasks run from framework_loop(), most urgent priority first.
+// Once a pass has used SCHED_PASS_BUDGET us, tasks below TASK_PRIORITY_HIGH
+// that are due wait for the next pass. A task that runs longer than its
+// budget (us, 0 for none) is counted, and its first overrun logged.
+#define MAX_TASKS           16
+#define SCHED_PASS_BUDGET   10000   /* us */
+
+enum TaskPriority { TASK_PRIORITY_HIGH, TASK_PRIORITY_NORMAL, TASK_PRIORITY_LOW };
+
+typedef void (*task_callback_t)();
+
+typedef struct {
+  const char      *name;
+  task_callback_t callback;
+  uint32_t        interval;   /* ms, 0 to run every pass */
+  uint32_t        due;        /* millis() of the next run */
+  uint32_t        budget;     /* us */
+  uint8_t         priority;
+  bool            oneShot;
+  bool            used;
+  uint32_t        runs;
+  uint32_t        overruns;
+  uint32_t        maxMicros;  /* Longest run */
+} task_t;
+
+// Add a periodic task, first run on the next pass. Returns its id, or -1
+// if the table is full.
+extern int8_t framework_add_task(const char *name, task_callback_t callback,
+    uint32_t interval, uint8_t priority = TASK_PRIORITY_NORMAL, uint32_t budget = 0);
+
+// Add a task run once after delay ms.
+extern int8_t framework_add_oneshot(const char *name, task_callback_t callback,
+    uint32_t delay, uint8_t priority = TASK_PRIORITY_NORMAL, uint32_t budget = 0);
+
+extern void framework_remove_task(int8_t id);
+
+// Run a task on the next pass, whenever it was due.
+extern void framework_wake_task(int8_t id);
+
+// Task table, MAX_TASKS long, for stats.
+extern const task_t * framework_tasks();
+
+// Longest time between two framework_loop() calls, in us.
+extern uint32_t framework_loop_max();
+
 
 #endif  // FRAMEWORK_H_
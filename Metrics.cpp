@@ -0,0 +1,158 @@
+/*
+* Metrics.cpp
+*
+* Project: ESPixelStick - An ESP8266 and E1.31 based pixel driver
+* Copyright (c) 2016 Shelby Merrick
+* http://www.forkineye.com
+*
+*  This program is provided free for you to use in any way that you wish,
+*  subject to the laws and regulations where you are using it.  Due diligence
+*  is strongly suggested before using this code.  Please give credit where due.
+*
+*  The Author makes no warranty of any kind, express or implied, with regard
+*  to this program or the documentation contained in this document.  The
+*  Author shall not be liable in any event for incidental or consequential
+*  damages in connection with, or arising out of, the furnishing, performance
+*  or use of these programs.
+*
+*/
+
+#include "Metrics.h"
+
+const uint32_t Metrics::BOUNDS[BUCKETS] = {
+    100, 500, 1000, 5000, 10000, 50000, 100000, 500000
+};
+
+int8_t Metrics::addHandler(const char *name) {
+    if (_handlerCount >= MAX_HANDLERS)
+        return -1;
+    _handlerNames[_handlerCount] = name;
+    return _handlerCount++;
+}
+
+void Metrics::sampleHeap() {
+    uint32_t free = ESP.getFreeHeap();
+    if (free < _minFreeHeap)
+        _minFreeHeap = free;
+}
+
+void Metrics::request(int8_t handler, uint32_t us) {
+    if (handler >= 0 && handler < _handlerCount)
+        add(_handlers[handler], us);
+}
+
+void Metrics::otaStart() {
+    _otaStart = millis();
+    _otaUploadBytes = 0;
+}
+
+void Metrics::otaEnd() {
+    uint32_t elapsed = millis() - _otaStart;
+    if (elapsed)
+        _otaRate = (uint64_t)_otaUploadBytes * 1000 / elapsed;
+}
+
+void Metrics::add(histogram_t &histogram, uint32_t value) {
+    uint8_t i = 0;
+    while (i < BUCKETS && value > BOUNDS[i])
+        i++;
+    histogram.buckets[i]++;
+    histogram.count++;
+    histogram.sum += value;
+}
+
+/* Print has no 64-bit integer path and its float path overflows past 2^32,
+   so print in parts of 9 decimal digits */
+static void printUint64(Print &out, uint64_t value) {
+    if (value >> 32) {
+        printUint64(out, value / 1000000000);
+        char low[10];
+        snprintf(low, sizeof(low), "%09lu", (unsigned long)(value % 1000000000));
+        out.print(low);
+    } else {
+        out.print((uint32_t)value);
+    }
+}
+
+void Metrics::writeHistogram(Print &out, const char *name,
+        const histogram_t &histogram, const char *handler) {
+    uint32_t total = 0;
+    for (uint8_t i = 0; i <= BUCKETS; i++) {
+        total += histogram.buckets[i];
+        out.print(name);
+        out.print(F("_bucket{"));
+        if (handler) {
+            out.print(F("handler=\""));
+            out.print(handler);
+            out.print(F("\","));
+        }
+        out.print(F("le=\""));
+        if (i < BUCKETS)
+            out.print(BOUNDS[i]);
+        else
+            out.print(F("+Inf"));
+        out.print(F("\"} "));
+        out.println(total);
+    }
+
+    const char *labels[] = { "_sum", "_count" };
+    for (uint8_t i = 0; i < 2; i++) {
+        out.print(name);
+        out.print(labels[i]);
+        if (handler) {
+            out.print(F("{handler=\""));
+            out.print(handler);
+            out.print(F("\"}"));
+        }
+        out.print(' ');
+        if (i == 0)
+            printUint64(out, histogram.sum);
+        else
+            out.print(histogram.count);
+        out.println();
+    }
+}
+
+static void writeMetric(Print &out, const __FlashStringHelper *name,
+        const __FlashStringHelper *type, const __FlashStringHelper *labels,
+        uint64_t value) {
+    if (type) {
+        out.print(F("# TYPE "));
+        out.print(name);
+        out.print(' ');
+        out.println(type);
+    }
+    out.print(name);
+    if (labels)
+        out.print(labels);
+    out.print(' ');
+    printUint64(out, value);
+    out.println();
+}
+
+void Metrics::write(Print &out) {
+    sampleHeap();
+
+    writeMetric(out, F("esps_heap_free_bytes"), F("gauge"), nullptr, ESP.getFreeHeap());
+    writeMetric(out, F("esps_heap_min_free_bytes"), F("gauge"), nullptr, _minFreeHeap);
+    writeMetric(out, F("esps_heap_max_block_bytes"), F("gauge"), nullptr, ESP.getMaxFreeBlockSize());
+    writeMetric(out, F("esps_heap_fragmentation_percent"), F("gauge"), nullptr, ESP.getHeapFragmentation());
+    writeMetric(out, F("esps_uptime_ms"), F("counter"), nullptr, millis());
+
+    out.println(F("# TYPE esps_loop_duration_us histogram"));
+    writeHistogram(out, "esps_loop_duration_us", _loop);
+
+    out.println(F("# TYPE esps_http_request_duration_us histogram"));
+    for (uint8_t i = 0; i < _handlerCount; i++)
+        writeHistogram(out, "esps_http_request_duration_us", _handlers[i], _handlerNames[i]);
+
+    writeMetric(out, F("esps_ws_messages_total"), F("counter"), F("{direction=\"in\"}"), _wsInCount);
+    writeMetric(out, F("esps_ws_messages_total"), nullptr, F("{direction=\"out\"}"), _wsOutCount);
+    writeMetric(out, F("esps_ws_bytes_total"), F("counter"), F("{direction=\"in\"}"), _wsInBytes);
+    writeMetric(out, F("esps_ws_bytes_total"), nullptr, F("{direction=\"out\"}"), _wsOutBytes);
+    writeMetric(out, F("esps_ws_dropped_total"), F("counter"), nullptr, _wsDropped);
+    writeMetric(out, F("esps_ws_rejected_total"), F("counter"), nullptr, _wsRejected);
+
+    writeMetric(out, F("esps_ota_bytes_total"), F("counter"), nullptr, _otaBytes);
+    writeMetric(out, F("esps_ota_last_rate_bytes_per_second"), F("gauge"), nullptr, _otaRate);
+}
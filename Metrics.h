@@ -0,0 +1,84 @@
+/*
+* Metrics.h
+*
+* Project: ESPixelStick - An ESP8266 and E1.31 based pixel driver
+* Copyright (c) 2016 Shelby Merrick
+* http://www.forkineye.com
+*
+*  This program is provided free for you to use in any way that you wish,
+*  subject to the laws and regulations where you are using it.  Due diligence
+*  is strongly suggested before using this code.  Please give credit where due.
+*
+*  The Author makes no warranty of any kind, express or implied, with regard
+*  to this program or the documentation contained in this document.  The
+*  Author shall not be liable in any event for incidental or consequential
+*  damages in connection with, or arising out of, the furnishing, performance
+*  or use of these programs.
+*
+*/
+
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <Arduino.h>
+
+/* Run-time counters, written out in Prometheus text format.  Everything is
+   updated from the loop or async callbacks, which don't preempt each
+   other, so plain increments are enough; there are no locks and no
+   allocations after startup. */
+class Metrics {
+ public:
+    static const uint8_t MAX_HANDLERS = 8;
+    static const uint8_t BUCKETS = 8;
+
+    /* Histogram bucket upper bounds in us, plus +Inf */
+    static const uint32_t BOUNDS[BUCKETS];
+
+    typedef struct {
+        uint32_t    buckets[BUCKETS + 1];   /* Not cumulative */
+        uint32_t    count;
+        uint64_t    sum;
+    } histogram_t;
+
+    /* Register a request handler by name (e.g. its path) for timing.
+       Returns its id, or -1 if there's no room. */
+    int8_t addHandler(const char *name);
+
+    void sampleHeap();
+    void loopPass(uint32_t us) { add(_loop, us); }
+    void request(int8_t handler, uint32_t us);
+    void wsReceived(size_t len) { _wsInCount++; _wsInBytes += len; }
+    void wsSent(size_t len) { _wsOutCount++; _wsOutBytes += len; }
+    void wsDropped() { _wsDropped++; }
+    void wsRejected() { _wsRejected++; }
+    void otaStart();
+    void otaData(size_t len) { _otaBytes += len; _otaUploadBytes += len; }
+    void otaEnd();
+
+    uint32_t getMinFreeHeap() { return _minFreeHeap; }
+
+    void write(Print &out);
+
+ private:
+    static void add(histogram_t &histogram, uint32_t value);
+    static void writeHistogram(Print &out, const char *name,
+            const histogram_t &histogram, const char *handler = nullptr);
+
+    uint32_t    _minFreeHeap = UINT32_MAX;
+    histogram_t _loop = {};
+    const char  *_handlerNames[MAX_HANDLERS];
+    histogram_t _handlers[MAX_HANDLERS] = {};
+    uint8_t     _handlerCount = 0;
+    uint32_t    _wsInCount = 0;
+    uint64_t    _wsInBytes = 0;
+    uint32_t    _wsOutCount = 0;
+    uint64_t    _wsOutBytes = 0;
+    uint32_t    _wsDropped = 0;
+    uint32_t    _wsRejected = 0;
+    uint64_t    _otaBytes = 0;
+    uint32_t    _otaStart = 0;
+    uint32_t    _otaUploadBytes = 0;
+    uint32_t    _otaRate = 0;       /* Bytes/s of the last finished upload */
+};
+
+#endif /* METRICS_H_ */
@@ -0,0 +1,107 @@
+/*
+* StateEvents.cpp
+*
+* Project: ESPixelStick - An ESP8266 and E1.31 based pixel driver
+* Copyright (c) 2016 Shelby Merrick
+* http://www.forkineye.com
+*
+*  This program is provided free for you to use in any way that you wish,
+*  subject to the laws and regulations where you are using it.  Due diligence
+*  is strongly suggested before using this code.  Please give credit where due.
+*
+*  The Author makes no warranty of any kind, express or implied, with regard
+*  to this program or the documentation contained in this document.  The
+*  Author shall not be liable in any event for incidental or consequential
+*  damages in connection with, or arising out of, the furnishing, performance
+*  or use of these programs.
+*
+*/
+
+#include "StateEvents.h"
+
+#define KEEPALIVE_INTERVAL  15000   /* ms of silence before a keepalive */
+#define RETRY_INTERVAL      2000    /* Client reconnect delay, ms */
+
+void StateEvents::begin(AsyncWebServer &server) {
+    _source.onConnect([this](AsyncEventSourceClient *client) {
+        connect(client);
+    });
+    server.addHandler(&_source);
+}
+
+void StateEvents::publish(const char *name, const char *data) {
+    name_t *slot = nullptr;
+    for (uint8_t i = 0; i < _nameCount; i++) {
+        if (_names[i].name == name || !strcmp(_names[i].name, name)) {
+            slot = &_names[i];
+            break;
+        }
+    }
+
+    if (!slot) {
+        if (_nameCount >= MAX_NAMES)
+            return;
+        slot = &_names[_nameCount++];
+        slot->name = name;
+        slot->latest[0] = 0;
+    }
+
+    strncpy(slot->pending, data, DATA_LEN - 1);
+    slot->pending[DATA_LEN - 1] = 0;
+    slot->dirty = true;
+}
+
+void StateEvents::flush() {
+    for (uint8_t i = 0; i < _nameCount; i++) {
+        name_t &slot = _names[i];
+        if (!slot.dirty)
+            continue;
+        slot.dirty = false;
+
+        // Changed back before it was sent
+        if (!strcmp(slot.pending, slot.latest))
+            continue;
+        strcpy(slot.latest, slot.pending);
+
+        event_t &event = _ring[++_id & (RING - 1)];
+        event.id = _id;
+        event.name = i;
+        strcpy(event.data, slot.latest);
+
+        if (_source.count())
+            _source.send(event.data, slot.name, event.id);
+        _lastSend = millis();
+    }
+
+    if (millis() - _lastSend >= KEEPALIVE_INTERVAL) {
+        if (_source.count())
+            _source.send("", "keepalive");
+        _lastSend = millis();
+    }
+}
+
+/* New or reconnecting client, from the async server */
+void StateEvents::connect(AsyncEventSourceClient *client) {
+    if (_source.count() > MAX_CLIENTS) {
+        client->close();
+        return;
+    }
+
+    // Replay what it missed if the ring still has it all
+    uint32_t last = client->lastId();
+    if (last && last <= _id && _id - last < RING) {
+        for (uint32_t id = last + 1; id <= _id; id++) {
+            event_t &event = _ring[id & (RING - 1)];
+            client->send(event.data, _names[event.name].name, event.id,
+                    RETRY_INTERVAL);
+        }
+        return;
+    }
+
+    // Otherwise the current value of everything
+    for (uint8_t i = 0; i < _nameCount; i++) {
+        if (_names[i].latest[0])
+            client->send(_names[i].latest, _names[i].name, _id,
+                    RETRY_INTERVAL);
+    }
+}
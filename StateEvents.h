@@ -0,0 +1,75 @@
+/*
+* StateEvents.h
+*
+* Project: ESPixelStick - An ESP8266 and E1.31 based pixel driver
+* Copyright (c) 2016 Shelby Merrick
+* http://www.forkineye.com
+*
+*  This program is provided free for you to use in any way that you wish,
+*  subject to the laws and regulations where you are using it.  Due diligence
+*  is strongly suggested before using this code.  Please give credit where due.
+*
+*  The Author makes no warranty of any kind, express or implied, with regard
+*  to this program or the documentation contained in this document.  The
+*  Author shall not be liable in any event for incidental or consequential
+*  damages in connection with, or arising out of, the furnishing, performance
+*  or use of these programs.
+*
+*/
+
+#ifndef STATEEVENTS_H_
+#define STATEEVENTS_H_
+
+#include <ESPAsyncWebServer.h>
+
+/* Server-Sent Events for state changes.  Events are named (the name must
+   be a string literal) and coalesced: publishing the same name again
+   before the next flush() replaces the pending value, so a burst of
+   changes costs one message.  Sent events are kept in a small ring, and a
+   client reconnecting with Last-Event-ID gets what it missed, or the
+   latest value of every event if that has been overwritten.  Clients
+   beyond MAX_CLIENTS are turned away, and the library caps each client's
+   queue, so each client costs a bounded amount of RAM. */
+class StateEvents {
+ public:
+    static const uint8_t MAX_NAMES = 8;
+    static const uint8_t RING = 16;         /* Power of two */
+    static const uint8_t DATA_LEN = 32;
+    static const uint8_t MAX_CLIENTS = 4;
+
+    StateEvents(const char *url) : _source(url) {}
+
+    void begin(AsyncWebServer &server);
+
+    void publish(const char *name, const char *data);
+
+    /* Send pending events, and a keepalive if the stream has been idle */
+    void flush();
+
+    size_t count() { return _source.count(); }
+
+ private:
+    typedef struct {
+        const char  *name;
+        char        latest[DATA_LEN];   /* Last sent */
+        char        pending[DATA_LEN];
+        bool        dirty;
+    } name_t;
+
+    typedef struct {
+        uint32_t    id;
+        uint8_t     name;               /* Index into _names */
+        char        data[DATA_LEN];
+    } event_t;
+
+    void connect(AsyncEventSourceClient *client);
+
+    AsyncEventSource    _source;
+    name_t              _names[MAX_NAMES];
+    uint8_t             _nameCount = 0;
+    event_t             _ring[RING];
+    uint32_t            _id = 0;        /* Last id sent */
+    uint32_t            _lastSend = 0;
+};
+
+#endif /* STATEEVENTS_H_ */
@@ -0,0 +1,106 @@
+/*
+* StatusDisplay.cpp
+*
+* Project: ESPixelStick - An ESP8266 and E1.31 based pixel driver
+* Copyright (c) 2016 Shelby Merrick
+* http://www.forkineye.com
+*
+*  This program is provided free for you to use in any way that you wish,
+*  subject to the laws and regulations where you are using it.  Due diligence
+*  is strongly suggested before using this code.  Please give credit where due.
+*
+*  The Author makes no warranty of any kind, express or implied, with regard
+*  to this program or the documentation contained in this document.  The
+*  Author shall not be liable in any event for incidental or consequential
+*  damages in connection with, or arising out of, the furnishing, performance
+*  or use of these programs.
+*
+*/
+
+#include "StatusDisplay.h"
+
+StatusDisplay::StatusDisplay(Adafruit_SSD1306 &display, TwoWire &wire,
+        uint8_t address) : _display(display), _wire(wire), _address(address) {
+    _cols = _display.width() / CELL_WIDTH;
+    _rows = _display.height() / CELL_HEIGHT;
+    clear();
+}
+
+void StatusDisplay::clear() {
+    for (uint8_t row = 0; row < MAX_ROWS; row++)
+        for (uint8_t col = 0; col < MAX_COLS; col++)
+            _next[row][col] = ' ';
+}
+
+uint8_t StatusDisplay::print(uint8_t row, uint8_t col, const char *text,
+        bool inverse) {
+    if (row >= _rows)
+        return col;
+
+    while (*text && col < _cols)
+        _next[row][col++] = (uint8_t)*text++ | (inverse ? INVERSE : 0);
+    return col;
+}
+
+void StatusDisplay::update() {
+    _bytesSent = 0;
+
+    if (_full) {
+        _display.clearDisplay();
+        _display.setTextSize(1);
+        _display.cp437(true);
+    }
+
+    for (uint8_t row = 0; row < _rows; row++) {
+        int16_t first = -1;
+        int16_t last = -1;
+
+        for (uint8_t col = 0; col < _cols; col++) {
+            uint16_t cell = _next[row][col];
+            if (!_full && cell == _shown[row][col])
+                continue;
+
+            bool inverse = cell & INVERSE;
+            _display.drawChar(col * CELL_WIDTH, row * CELL_HEIGHT, cell & 0xFF,
+                    inverse ? SSD1306_BLACK : SSD1306_WHITE,
+                    inverse ? SSD1306_WHITE : SSD1306_BLACK, 1);
+            _shown[row][col] = cell;
+
+            if (first < 0)
+                first = col;
+            last = col;
+        }
+
+        if (!_full && first >= 0)
+            send(row, first * CELL_WIDTH, (last + 1) * CELL_WIDTH - 1);
+    }
+
+    if (_full) {
+        _display.display();
+        _bytesSent = _display.width() * _display.height() / 8;
+        _full = false;
+    }
+}
+
+/* Send columns x0..x1 of one page from the frame buffer */
+void StatusDisplay::send(uint8_t page, uint8_t x0, uint8_t x1) {
+    _display.ssd1306_command(SSD1306_PAGEADDR);
+    _display.ssd1306_command(page);
+    _display.ssd1306_command(page);
+    _display.ssd1306_command(SSD1306_COLUMNADDR);
+    _display.ssd1306_command(x0);
+    _display.ssd1306_command(x1);
+
+    const uint8_t *data = _display.getBuffer() + page * _display.width() + x0;
+    uint16_t left = x1 - x0 + 1;
+    _bytesSent += left;
+    while (left) {
+        uint8_t chunk = left < WIRE_MAX - 1 ? left : WIRE_MAX - 1;
+        _wire.beginTransmission(_address);
+        _wire.write((uint8_t)0x40);     // Data
+        _wire.write(data, chunk);
+        _wire.endTransmission();
+        data += chunk;
+        left -= chunk;
+    }
+}
@@ -0,0 +1,73 @@
+/*
+* StatusDisplay.h
+*
+* Project: ESPixelStick - An ESP8266 and E1.31 based pixel driver
+* Copyright (c) 2016 Shelby Merrick
+* http://www.forkineye.com
+*
+*  This program is provided free for you to use in any way that you wish,
+*  subject to the laws and regulations where you are using it.  Due diligence
+*  is strongly suggested before using this code.  Please give credit where due.
+*
+*  The Author makes no warranty of any kind, express or implied, with regard
+*  to this program or the documentation contained in this document.  The
+*  Author shall not be liable in any event for incidental or consequential
+*  damages in connection with, or arising out of, the furnishing, performance
+*  or use of these programs.
+*
+*/
+
+#ifndef STATUSDISPLAY_H_
+#define STATUSDISPLAY_H_
+
+#include <Wire.h>
+#include <Adafruit_SSD1306.h>
+
+/* Text status screen for an SSD1306 that only sends what changed.  The
+   screen is a grid of 6x8 glyph cells, one text row per display page.  Each
+   update() diffs the new text against what was last drawn, redraws just the
+   changed cells and sends only the column window they span on each page,
+   so an unchanged screen costs no I2C traffic at all. */
+class StatusDisplay {
+ public:
+    static const uint8_t CELL_WIDTH = 6;
+    static const uint8_t CELL_HEIGHT = 8;
+    static const uint8_t MAX_COLS = 128 / CELL_WIDTH;
+    static const uint8_t MAX_ROWS = 64 / CELL_HEIGHT;
+
+    StatusDisplay(Adafruit_SSD1306 &display, TwoWire &wire, uint8_t address);
+
+    /* Start a new frame, all blank */
+    void clear();
+
+    /* Put text at row, col.  Returns the column after it; text past the end
+       of the row is dropped. */
+    uint8_t print(uint8_t row, uint8_t col, const char *text, bool inverse = false);
+
+    /* Draw and send the cells that differ from the last update */
+    void update();
+
+    /* Redraw everything on the next update, e.g. after drawing directly */
+    void invalidate() { _full = true; }
+
+    /* Display data bytes sent by the last update */
+    uint16_t getBytesSent() { return _bytesSent; }
+
+ private:
+    static const uint16_t INVERSE = 0x100;
+    static const uint8_t WIRE_MAX = 32;
+
+    void send(uint8_t page, uint8_t x0, uint8_t x1);
+
+    Adafruit_SSD1306    &_display;
+    TwoWire             &_wire;
+    uint8_t             _address;
+    uint8_t             _cols;
+    uint8_t             _rows;
+    bool                _full = true;
+    uint16_t            _bytesSent = 0;
+    uint16_t            _next[MAX_ROWS][MAX_COLS];  /* Glyph | INVERSE */
+    uint16_t            _shown[MAX_ROWS][MAX_COLS];
+};
+
+#endif /* STATUSDISPLAY_H_ */
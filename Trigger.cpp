@@ -0,0 +1,170 @@
+/*
+* Trigger.cpp
+*
+* Project: ESPixelStick - An ESP8266 and E1.31 based pixel driver
+* Copyright (c) 2016 Shelby Merrick
+* http://www.forkineye.com
+*
+*  This program is provided free for you to use in any way that you wish,
+*  subject to the laws and regulations where you are using it.  Due diligence
+*  is strongly suggested before using this code.  Please give credit where due.
+*
+*  The Author makes no warranty of any kind, express or implied, with regard
+*  to this program or the documentation contained in this document.  The
+*  Author shall not be liable in any event for incidental or consequential
+*  damages in connection with, or arising out of, the furnishing, performance
+*  or use of these programs.
+*
+*/
+
+#include "Trigger.h"
+
+void Trigger::begin(uint8_t pin, uint8_t onLevel) {
+    _pin = pin;
+    _onLevel = onLevel;
+    pinMode(_pin, OUTPUT);
+    digitalWrite(_pin, !_onLevel);
+}
+
+bool Trigger::addInput(uint8_t pin, uint8_t activeLevel, Mode mode,
+        uint16_t debounceMs) {
+    if (_inputCount >= MAX_INPUTS)
+        return false;
+
+    input_t *input = &_inputs[_inputCount++];
+    input->trigger = this;
+    input->pin = pin;
+    input->activeLevel = activeLevel;
+    input->mode = mode;
+    input->debounceMs = debounceMs;
+    input->active = digitalRead(pin) == activeLevel;
+    input->lastEdge = millis();
+    input->seenActive = micros();
+    attachInterruptArg(digitalPinToInterrupt(pin), isr, input, CHANGE);
+    return true;
+}
+
+void Trigger::setMode(uint8_t input, Mode mode) {
+    if (input < _inputCount)
+        _inputs[input].mode = mode;
+}
+
+void Trigger::setTiming(uint32_t onMs, uint32_t offMs) {
+    _onMs = onMs;
+    _offMs = offMs;
+}
+
+void Trigger::setEnabled(bool enabled) {
+    noInterrupts();
+    _enabled = enabled;
+    if (!enabled)
+        _state = IDLE;
+    interrupts();
+}
+
+/* Switch on, or restart the on time, from an edge on input seen at start
+   (micros) */
+void ICACHE_RAM_ATTR Trigger::fire(uint8_t input, uint32_t start) {
+    if (_state == IDLE) {
+        digitalWrite(_pin, _onLevel);
+        _state = ON;
+        _count++;
+        _lastInput = input;
+        _lastLatency = micros() - start;
+        if (_lastLatency > _maxLatency)
+            _maxLatency = _lastLatency;
+    }
+    _since = millis();
+}
+
+void ICACHE_RAM_ATTR Trigger::isr(void *arg) {
+    uint32_t start = micros();
+    input_t *input = static_cast<input_t *>(arg);
+    Trigger *trigger = input->trigger;
+
+    bool active = digitalRead(input->pin) == input->activeLevel;
+    if (active == input->active)
+        return;
+    if (active)
+        input->seenActive = start;
+
+    /* Bounces within the debounce time of the last accepted edge */
+    uint32_t now = millis();
+    if (now - input->lastEdge < input->debounceMs)
+        return;
+    input->lastEdge = now;
+    input->active = active;
+
+    if (!active || !trigger->_enabled || input->mode == DISABLED)
+        return;
+
+    if (trigger->_state == IDLE ||
+            (trigger->_state == ON && input->mode == RETRIGGER))
+        trigger->fire(input - trigger->_inputs, start);
+}
+
+void Trigger::off() {
+    digitalWrite(_pin, !_onLevel);
+    _state = OFF;
+    _since = millis();
+    _offMicros = micros();
+
+    /* Inputs held through the on time can't fire before the off time ends,
+       keep their times close to it so the comparison in handle() can't wrap */
+    for (uint8_t i = 0; i < _inputCount; i++) {
+        if (_inputs[i].active)
+            _inputs[i].seenActive = _offMicros;
+    }
+}
+
+void Trigger::handle() {
+    if (!_enabled)
+        return;
+
+    noInterrupts();
+    uint32_t now = millis();
+    bool offEnded = false;
+
+    /* Resample settled inputs, in case a bounce hid their last edge */
+    for (uint8_t i = 0; i < _inputCount; i++) {
+        input_t *input = &_inputs[i];
+        if (now - input->lastEdge >= input->debounceMs)
+            input->active = digitalRead(input->pin) == input->activeLevel;
+    }
+
+    switch (_state) {
+        case ON:
+            /* HOLD inputs keep the on time from starting */
+            for (uint8_t i = 0; i < _inputCount; i++) {
+                if (_inputs[i].mode == HOLD && _inputs[i].active)
+                    _since = now;
+            }
+            if (now - _since >= _onMs)
+                off();
+            break;
+
+        case OFF:
+            if (now - _since < _offMs)
+                break;
+            _state = IDLE;
+            offEnded = true;
+            // Fall through
+
+        case IDLE:
+            /* Inputs still active fire again, as if they'd just gone active.
+               Latency counts from when the input was seen active, or from
+               the end of the off time if it was already active then. */
+            for (uint8_t i = 0; i < _inputCount; i++) {
+                if (_inputs[i].mode != DISABLED && _inputs[i].active) {
+                    uint32_t start = _inputs[i].seenActive;
+                    uint32_t ready = _offMicros + _offMs * 1000;
+                    if (offEnded && (int32_t)(ready - start) > 0)
+                        start = ready;
+                    fire(i, start);
+                    break;
+                }
+            }
+            break;
+    }
+    interrupts();
+}
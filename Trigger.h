@@ -0,0 +1,101 @@
+/*
+* Trigger.h
+*
+* Project: ESPixelStick - An ESP8266 and E1.31 based pixel driver
+* Copyright (c) 2016 Shelby Merrick
+* http://www.forkineye.com
+*
+*  This program is provided free for you to use in any way that you wish,
+*  subject to the laws and regulations where you are using it.  Due diligence
+*  is strongly suggested before using this code.  Please give credit where due.
+*
+*  The Author makes no warranty of any kind, express or implied, with regard
+*  to this program or the documentation contained in this document.  The
+*  Author shall not be liable in any event for incidental or consequential
+*  damages in connection with, or arising out of, the furnishing, performance
+*  or use of these programs.
+*
+*/
+
+#ifndef TRIGGER_H_
+#define TRIGGER_H_
+
+#include <Arduino.h>
+
+/* Drives one output from up to MAX_INPUTS trigger inputs without blocking.
+   Inputs are sampled by interrupt and debounced there; an active edge while
+   idle switches the output on from the interrupt itself, so trigger to
+   output latency is a few microseconds.  Timing is then run from handle(),
+   which must be called from loop().  An edge hidden by the debounce, or an
+   input still active when the off time ends, fires from handle() instead;
+   its latency is measured from when the input was seen active, or the off
+   time ended, so it includes the wait for the loop.
+
+   Once on, the output stays on for the on time and is then held off for
+   the off time, during which inputs are ignored.  Per input modes:
+     PULSE      - Fire when the input goes active, and again after the off
+                  time while it stays active
+     RETRIGGER  - As PULSE, and an active edge while on restarts the on time
+     HOLD       - Stay on while the input is active, then for the on time
+*/
+class Trigger {
+ public:
+    enum Mode : uint8_t { DISABLED, PULSE, RETRIGGER, HOLD };
+
+    static const uint8_t MAX_INPUTS = 4;
+
+    /* Output pin and the level that switches it on */
+    void begin(uint8_t pin, uint8_t onLevel);
+
+    /* Add an input, active when it reads activeLevel */
+    bool addInput(uint8_t pin, uint8_t activeLevel, Mode mode,
+            uint16_t debounceMs = 20);
+    void setMode(uint8_t input, Mode mode);
+    void setTiming(uint32_t onMs, uint32_t offMs);
+
+    /* Triggers are ignored while disabled, the output is left alone */
+    void setEnabled(bool enabled);
+
+    void handle();
+
+    bool isOn() { return _state == ON; }
+    uint32_t getCount() { return _count; }
+    uint8_t getLastInput() { return _lastInput; }          /* Fired last */
+    uint32_t getLastLatency() { return _lastLatency; }     /* us */
+    uint32_t getMaxLatency() { return _maxLatency; }       /* us */
+
+ private:
+    enum State : uint8_t { IDLE, ON, OFF };
+
+    typedef struct {
+        Trigger             *trigger;
+        uint8_t             pin;
+        uint8_t             activeLevel;
+        volatile Mode       mode;
+        uint16_t            debounceMs;
+        volatile bool       active;     /* Debounced input state */
+        volatile uint32_t   lastEdge;   /* millis() of the last accepted edge */
+        volatile uint32_t   seenActive; /* micros() of the last edge to active */
+    } input_t;
+
+    static void ICACHE_RAM_ATTR isr(void *arg);
+    void ICACHE_RAM_ATTR fire(uint8_t input, uint32_t start);
+    void off();
+
+    input_t             _inputs[MAX_INPUTS];
+    uint8_t             _inputCount = 0;
+    uint8_t             _pin;
+    uint8_t             _onLevel;
+    uint32_t            _onMs = 2000;
+    uint32_t            _offMs = 2000;
+    volatile bool       _enabled = true;
+    volatile State      _state = IDLE;
+    volatile uint32_t   _since = 0;     /* millis() the state was entered */
+    uint32_t            _offMicros = 0; /* micros() the output went off */
+    volatile uint32_t   _count = 0;
+    volatile uint8_t    _lastInput = 0;
+    volatile uint32_t   _lastLatency = 0;
+    volatile uint32_t   _maxLatency = 0;
+};
+
+#endif /* TRIGGER_H_ */
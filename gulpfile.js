@@ -9,6 +9,33 @@ var gzip = require('gulp-gzip');
 var del = require('del');
 var markdown = require('gulp-markdown-github-style');
 var rename = require('gulp-rename');
+var crypto = require('crypto');
+var fs = require('fs');
+var path = require('path');
+var stream = require('stream');
+
+/* Content hash used for ETags and cache busting */
+function hashOf(contents) {
+    return crypto.createHash('sha256').update(contents).digest('hex').substr(0, 16);
+}
+
+/* Point asset references in HTML at ?v=<hash> so they can be cached forever */
+function versionAssets() {
+    return new stream.Transform({
+        objectMode: true,
+        transform: function(file, enc, done) {
+            var html = file.contents.toString();
+            ['esps.css', 'esps.js'].forEach(function(asset) {
+                var built = path.join('data/www', asset + '.gz');
+                if (fs.existsSync(built)) {
+                    html = html.split('"' + asset + '"').join('"' + asset + '?v=' + hashOf(fs.readFileSync(built)) + '"');
+                }
+            });
+            file.contents = Buffer.from(html);
+            done(null, file);
+        }
+    });
+}
 
 /* HTML Task */
 gulp.task('html', function() {
@@ -19,6 +46,7 @@ gulp.task('html', function() {
             removeComments: true,
             minifyCSS: true,
             minifyJS: true}))
+        .pipe(versionAssets())
         .pipe(gzip())
         .pipe(gulp.dest('data/www'));
 });
@@ -51,6 +79,18 @@ gulp.task('image', function() {
 });
 
 
+/* Manifest Task - content hash of each served file, keyed by request path */
+gulp.task('manifest', function(done) {
+    var manifest = {};
+    fs.readdirSync('data/www').forEach(function(name) {
+        if (name != 'manifest.json') {
+            manifest[name.replace(/\.gz$/, '')] = hashOf(fs.readFileSync(path.join('data/www', name)));
+        }
+    });
+    fs.writeFileSync('data/www/manifest.json', JSON.stringify(manifest));
+    done();
+});
+
 /* Clean Task */
 gulp.task('clean', function() {
     return del(['data/www/*']);
@@ -88,10 +128,10 @@ gulp.task('travis', function(done) {
 
 /* Watch Task */
 gulp.task('watch', function() {
-    gulp.watch('html/*.html', gulp.series('html'));
-    gulp.watch('html/**/*.css', gulp.series('css'));
-    gulp.watch('html/**/*.js', gulp.series('js'));
+    gulp.watch('html/*.html', gulp.series('html', 'manifest'));
+    gulp.watch('html/**/*.css', gulp.series('css', 'html', 'manifest'));
+    gulp.watch('html/**/*.js', gulp.series('js', 'html', 'manifest'));
 });
 
-/* Default Task */
-gulp.task('default', gulp.series(['clean', 'html', 'css', 'js', 'image']));
+/* Default Task - html goes after css and js so it can version them */
+gulp.task('default', gulp.series(['clean', 'css', 'js', 'html', 'image', 'manifest']));
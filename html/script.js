@@ -26,7 +26,7 @@ $(function() {
 
         // Firmware selection and upload
         $('#efu').change(function () {
-            $('#updatefw').submit();
+            uploadFirmware(this.files[0], 0, 5);
             $('#update').modal();
         });
 
@@ -169,15 +169,9 @@ function wifiValidation() {
     $('#btn_wifi').prop('disabled', WifiSaveDisabled);
 }
 
-// Page event feeds
+// Page event feeds, pushed by the device once subscribed
 function feed() {
-    if ($('#home').is(':visible')) {
-        wsEnqueue('XJ');
-
-        setTimeout(function() {
-            feed();
-        }, 1000);
-    }
+    wsEnqueue($('#home').is(':visible') ? 'XS' : 'XS0');
 }
 
 function param(name) {
@@ -215,10 +209,10 @@ function wsConnect() {
                 switch (cmd) {
 
                 case 'G1':
-                    getConfig(data);
+                    getConfig(JSON.parse(data));
                     break;
                 case 'G2':
-                    getConfigStatus(data);
+                    getConfigStatus(JSON.parse(data));
                     break;
                 case 'S1':
                     setConfig(data);
@@ -228,7 +222,7 @@ function wsConnect() {
                     setConfig(data);
                     break;
                 case 'XJ':
-                    getJsonStatus(data);
+                    getJsonStatus(JSON.parse(data));
                     break;
                 case 'X6':
                     showReboot();
@@ -238,9 +232,31 @@ function wsConnect() {
                     break;
                 }
             } else {
-                streamData= new Uint8Array(event.data);
-                drawStream(streamData);
-                if ($('#diag').is(':visible')) wsEnqueue('V1');
+                var bytes = new Uint8Array(event.data);
+                var cmd = String.fromCharCode(bytes[0], bytes[1]);
+                switch (cmd) {
+
+                case 'G1':
+                    getConfig(msgpackDecode(bytes, 2));
+                    break;
+                case 'G2':
+                    getConfigStatus(msgpackDecode(bytes, 2));
+                    break;
+                case 'XJ':
+                    var view = new DataView(event.data);
+                    getJsonStatus({ system: {
+                        rssi: view.getInt32(2, true),
+                        freeheap: view.getUint32(6, true),
+                        uptime: view.getUint32(10, true),
+                        maxblock: view.getUint32(14, true),
+                        minheap: view.getUint32(18, true),
+                        frag: view.getUint8(22)
+                    }});
+                    break;
+                default:
+                    console.log('Unknown Binary Command: ' + cmd);
+                    break;
+                }
             }
             wsReadyToSend();
         };
@@ -291,8 +307,69 @@ function wsProcessQueue() {
         wsTimerId=setTimeout(wsReadyToSend,timeout);
         //send it.
         //console.log('WS sending ' + message);
-        ws.send(message);
+        if (wsBinary.indexOf(message) != -1)
+            ws.send(new TextEncoder().encode(message));
+        else
+            ws.send(message);
+    }
+}
+
+// Requests that are sent as binary frames and answered in binary
+var wsBinary = ['XJ', 'G1', 'G2'];
+
+// Minimal MessagePack decoder for the G1 / G2 replies
+function msgpackDecode(bytes, offset) {
+    var view = new DataView(bytes.buffer, bytes.byteOffset);
+    var pos = offset;
+
+    function str(len) {
+        var s = new TextDecoder().decode(bytes.subarray(pos, pos + len));
+        pos += len;
+        return s;
     }
+    function arr(len) {
+        var a = [];
+        for (var i = 0; i < len; i++)
+            a.push(next());
+        return a;
+    }
+    function map(len) {
+        var m = {};
+        for (var i = 0; i < len; i++) {
+            var key = next();
+            m[key] = next();
+        }
+        return m;
+    }
+    function next() {
+        var b = bytes[pos++];
+        var v;
+        if (b <= 0x7f) return b;
+        if (b >= 0xe0) return b - 0x100;
+        if ((b & 0xf0) == 0x80) return map(b & 0x0f);
+        if ((b & 0xf0) == 0x90) return arr(b & 0x0f);
+        if ((b & 0xe0) == 0xa0) return str(b & 0x1f);
+        switch (b) {
+        case 0xc0: return null;
+        case 0xc2: return false;
+        case 0xc3: return true;
+        case 0xca: v = view.getFloat32(pos); pos += 4; return v;
+        case 0xcb: v = view.getFloat64(pos); pos += 8; return v;
+        case 0xcc: return bytes[pos++];
+        case 0xcd: v = view.getUint16(pos); pos += 2; return v;
+        case 0xce: v = view.getUint32(pos); pos += 4; return v;
+        case 0xd0: return view.getInt8(pos++);
+        case 0xd1: v = view.getInt16(pos); pos += 2; return v;
+        case 0xd2: v = view.getInt32(pos); pos += 4; return v;
+        case 0xd9: return str(bytes[pos++]);
+        case 0xda: v = view.getUint16(pos); pos += 2; return str(v);
+        case 0xdc: v = view.getUint16(pos); pos += 2; return arr(v);
+        case 0xde: v = view.getUint16(pos); pos += 2; return map(v);
+        }
+        throw new Error('Unsupported MessagePack type 0x' + b.toString(16));
+    }
+
+    return next();
 }
 
 function wsReadyToSend() {
@@ -307,15 +384,16 @@ function wsReadyToSend() {
 }
 
 
-function getConfig(data) {
-    var config = JSON.parse(data);
-
+function getConfig(config) {
     // Device and Network config
     $('#title').text('ESP - ' + config.device.id);
     $('#name').text(config.device.id);
     $('#devid').val(config.device.id);
     $('#millisOn').val(config.device.millisOn);
     $('#millisOff').val(config.device.millisOff);
+    $('#beamMode').val(config.device.beamMode);
+    $('#pirMode').val(config.device.pirMode);
+    $('#group').val(config.device.group);
     $('#useWifi').prop('checked', config.network.useWifi);
     if (config.network.useWifi) {
         $('.useWifi').removeClass('hidden');
@@ -349,9 +427,7 @@ function getConfig(data) {
  
 }
 
-function getConfigStatus(data) {
-    var status = JSON.parse(data);
-
+function getConfigStatus(status) {
     $('#x_ssid').text(status.ssid);
     $('#x_hostname').text(status.hostname);
     $('#x_ip').text(status.ip);
@@ -362,13 +438,19 @@ function getConfigStatus(data) {
     $('#x_usedflashsize').text(status.usedflashsize);
     $('#x_realflashsize').text(status.realflashsize);
     $('#x_freeheap').text(status.freeheap);
+    $('#x_timetoip').text(status.timetoip + ' ms' +
+            (status.fastconnect ? ' (cached)' : ''));
+    $('#x_loopmax').text(status.loopmax + ' us');
+    if (status.boot)
+        $('#x_boot').text('fs ' + status.boot.fs + ' ms, config ' +
+                status.boot.config + ' ms, web ' + status.boot.web +
+                ' ms, loop ' + status.boot.loop + ' ms, wifi ' +
+                status.boot.wifi + ' ms');
 }
 
 
 
-function getJsonStatus(data) {
-    var status = JSON.parse(data);
-
+function getJsonStatus(status) {
     var rssi = +status.system.rssi;
     var quality = 2 * (rssi + 100);
 
@@ -381,7 +463,11 @@ function getJsonStatus(data) {
     $('#x_quality').text(quality);
 
 // getHeap(data)
-    $('#x_freeheap').text( status.system.freeheap );
+    var heap = status.system.freeheap;
+    if (status.system.maxblock !== undefined)
+        heap += ' (min ' + status.system.minheap + ', max block ' +
+                status.system.maxblock + ', ' + status.system.frag + '% fragmented)';
+    $('#x_freeheap').text(heap);
 
 // getUptime
     var date = new Date(+status.system.uptime);
@@ -430,7 +516,10 @@ function submitConfig() {
             'device': {
                 'id': $('#devid').val(),
                 'millisOn': parseInt($('#millisOn').val()),
-                'millisOff': parseInt($('#millisOff').val())
+                'millisOff': parseInt($('#millisOff').val()),
+                'beamMode': parseInt($('#beamMode').val()),
+                'pirMode': parseInt($('#pirMode').val()),
+                'group': parseInt($('#group').val())
             },
     };
 
@@ -439,6 +528,43 @@ function submitConfig() {
 
 
 
+// Firmware upload.  If the connection drops, ask the device how far it got
+// and post the rest from there instead of starting over.
+function uploadFirmware(file, offset, retries) {
+    var form = new FormData();
+    form.append('file', file.slice(offset), file.name);
+
+    var xhr = new XMLHttpRequest();
+    xhr.open('POST', '/updatefw' + (offset ? '?offset=' + offset : ''));
+    xhr.onload = function() {
+        // Device had a different offset, it is in the response
+        if (xhr.status == 409 && retries > 0)
+            uploadFirmware(file, parseInt(xhr.responseText), retries - 1);
+    };
+    xhr.onerror = function() {
+        if (retries > 0) {
+            setTimeout(function() {
+                resumeFirmware(file, retries - 1);
+            }, 2000);
+        }
+    };
+    xhr.send(form);
+}
+
+function resumeFirmware(file, retries) {
+    $.get('/updatefw')
+        .done(function(data) {
+            uploadFirmware(file, parseInt(data), retries);
+        })
+        .fail(function() {
+            if (retries > 0) {
+                setTimeout(function() {
+                    resumeFirmware(file, retries - 1);
+                }, 2000);
+            }
+        });
+}
+
 function showReboot() {
     $('#update').modal('hide');
     $('#reboot').modal();
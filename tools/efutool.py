@@ -0,0 +1,265 @@
+#!/usr/bin/env python3
+#
+# efutool.py
+#
+# Project: ESPixelStick - An ESP8266 and E1.31 based pixel driver
+# Copyright (c) 2016 Shelby Merrick
+# http://www.forkineye.com
+#
+#  This program is provided free for you to use in any way that you wish,
+#  subject to the laws and regulations where you are using it.  Due diligence
+#  is strongly suggested before using this code.  Please give credit where due.
+#
+#  The Author makes no warranty of any kind, express or implied, with regard
+#  to this program or the documentation contained in this document.  The
+#  Author shall not be liable in any event for incidental or consequential
+#  damages in connection with, or arising out of, the furnishing, performance
+#  or use of these programs.
+#
+# Builds EFU firmware update images for upload through the web interface.
+#
+#   efutool.py keygen signing.pem
+#   efutool.py build -o out.efu --sketch sketch.bin [--spiffs spiffs.bin] [--key signing.pem] [--compress]
+#                    [--base running.bin]
+#
+# EFU layout (multi-byte fields are big endian):
+#   header  'E' 'F' 'U' 0x00, uint16 version
+#   record  uint16 type, uint32 size, <size> bytes of payload
+#   ...
+# A SIGNATURE record is an ECDSA P-256 raw (r || s) signature over the
+# SHA-256 of every byte ahead of it.  When signing, one follows each image.
+# A *_DEFLATE image record holds the uint32 uncompressed size followed by a
+# zlib stream limited to a 4 KB window, which is what the device inflates in.
+# A SKETCH_PATCH record is the same, with the MD5 of the sketch it patches
+# after the size.  The inflated stream is a run of control blocks
+# (int32 seek, uint32 diff, uint32 extra), each followed by <diff> bytes added
+# to the running sketch at the seeked position and <extra> literal bytes.
+
+import argparse
+import hashlib
+import os
+import struct
+import sys
+import zlib
+
+EFU_MAGIC = b'EFU\x00'
+EFU_VERSION = 1
+
+# Record types, see EFUpdate::RecordType
+NULL_RECORD = 0
+SKETCH_IMAGE = 1
+SPIFFS_IMAGE = 2
+EEPROM_IMAGE = 3
+SIGNATURE = 4
+SKETCH_IMAGE_DEFLATE = 5
+SPIFFS_IMAGE_DEFLATE = 6
+SKETCH_PATCH = 7
+
+# zlib window bits, must match EFUpdate::EFU_INFLATE_WINDOW
+INFLATE_WBITS = 12
+
+DEFLATED = {SKETCH_IMAGE: SKETCH_IMAGE_DEFLATE, SPIFFS_IMAGE: SPIFFS_IMAGE_DEFLATE}
+
+
+def load_ecdsa():
+    try:
+        import ecdsa
+    except ImportError:
+        # Fall back to the copy shipped with esptool
+        here = os.path.dirname(os.path.abspath(__file__))
+        sys.path.insert(0, os.path.join(here, '..', 'dist', 'bin', 'esptool'))
+        import ecdsa
+    return ecdsa
+
+
+def record(rtype, payload):
+    return struct.pack('>HI', rtype, len(payload)) + payload
+
+
+def deflate(rtype, payload):
+    comp = zlib.compressobj(9, zlib.DEFLATED, INFLATE_WBITS, 9)
+    packed = comp.compress(payload) + comp.flush()
+    return DEFLATED[rtype], struct.pack('>I', len(payload)) + packed
+
+
+# Patch generation.  Exact matches of MATCH_LEN bytes or more are found
+# through a hash of the base image and are then extended over small
+# differences (relocated addresses and the like), which become mostly zero
+# diff bytes that deflate well.
+MATCH_LEN = 16
+MAX_CANDIDATES = 8
+
+
+def match_len(old, o, new, n):
+    length = 0
+    while o + length < len(old) and n + length < len(new):
+        step = min(64, len(old) - o - length, len(new) - n - length)
+        if old[o + length:o + length + step] == new[n + length:n + length + step]:
+            length += step
+            continue
+        while old[o + length] == new[n + length]:
+            length += 1
+        break
+    return length
+
+
+def diff_segments(old, new):
+    """Split new into (start, length, delta) segments, where delta is the
+    offset into old to diff against, or None for literal bytes."""
+    index = {}
+    for o in range(len(old) - MATCH_LEN + 1):
+        bucket = index.setdefault(old[o:o + MATCH_LEN], [])
+        if len(bucket) < MAX_CANDIDATES:
+            bucket.append(o)
+
+    segments = []
+    delta = None
+    n = 0
+    literal = 0
+    while n < len(new):
+        best, best_len = None, 0
+        if delta is not None and 0 <= n + delta < len(old):
+            best_len = match_len(old, n + delta, new, n)
+            best = n + delta if best_len >= MATCH_LEN else None
+        if best is None:
+            best_len = 0
+            for o in index.get(new[n:n + MATCH_LEN], []):
+                length = match_len(old, o, new, n)
+                if length > best_len:
+                    best, best_len = o, length
+
+        if best is None:
+            n += 1
+            continue
+
+        # Bytes since the last match diff against the previous alignment
+        # when mostly equal, otherwise they go as-is
+        if n > literal:
+            gap = new[literal:n]
+            same = 0
+            if delta is not None and literal + delta >= 0 and n + delta <= len(old):
+                same = sum(1 for a, b in zip(gap, old[literal + delta:n + delta]) if a == b)
+            segments.append((literal, n - literal, delta if same * 2 >= len(gap) else None))
+
+        delta = best - n
+        segments.append((n, best_len, delta))
+        n += best_len
+        literal = n
+
+    if literal < len(new):
+        segments.append((literal, len(new) - literal, None))
+    return segments
+
+
+def make_patch(old, new):
+    out = bytearray()
+    pos = 0
+    ops = []
+    for start, length, delta in diff_segments(old, new):
+        if delta is None:
+            if not ops:
+                ops.append([0, b'', b''])
+            ops[-1][2] += new[start:start + length]
+        elif ops and not ops[-1][2] and start + delta == pos:
+            ops[-1][1] += bytes((new[start + i] - old[start + delta + i]) & 0xff for i in range(length))
+            pos += length
+        else:
+            seek = start + delta - pos
+            ops.append([seek, bytes((new[start + i] - old[start + delta + i]) & 0xff for i in range(length)), b''])
+            pos = start + delta + length
+    for seek, diff, extra in ops:
+        out += struct.pack('>iII', seek, len(diff), len(extra)) + diff + extra
+    return bytes(out)
+
+
+def patch(base, payload):
+    comp = zlib.compressobj(9, zlib.DEFLATED, INFLATE_WBITS, 9)
+    packed = comp.compress(make_patch(base, payload)) + comp.flush()
+    return SKETCH_PATCH, struct.pack('>I', len(payload)) + hashlib.md5(base).digest() + packed
+
+
+def sign(key, data):
+    ecdsa = load_ecdsa()
+    sig = key.sign_deterministic(data, hashfunc=hashlib.sha256,
+                                 sigencode=ecdsa.util.sigencode_string)
+    return record(SIGNATURE, sig)
+
+
+def build(images, key=None, compress=False, base=None):
+    efu = bytearray(EFU_MAGIC + struct.pack('>H', EFU_VERSION))
+    for rtype, payload in images:
+        if base and rtype == SKETCH_IMAGE:
+            rtype, payload = patch(base, payload)
+        elif compress:
+            rtype, payload = deflate(rtype, payload)
+        efu += record(rtype, payload)
+        if key:
+            efu += sign(key, bytes(efu))
+    return bytes(efu)
+
+
+def c_array(data):
+    return '{ ' + ', '.join('0x%02x' % b for b in data) + ' }'
+
+
+def cmd_keygen(args):
+    ecdsa = load_ecdsa()
+    key = ecdsa.SigningKey.generate(curve=ecdsa.NIST256p)
+    with open(args.keyfile, 'wb') as f:
+        f.write(key.to_pem())
+    pub = b'\x04' + key.get_verifying_key().to_string()
+    print('#define EFU_PUBLIC_KEY ' + c_array(pub))
+
+
+def cmd_build(args):
+    images = []
+    if args.sketch:
+        with open(args.sketch, 'rb') as f:
+            images.append((SKETCH_IMAGE, f.read()))
+    if args.spiffs:
+        with open(args.spiffs, 'rb') as f:
+            images.append((SPIFFS_IMAGE, f.read()))
+    if not images:
+        sys.exit('Nothing to build, give --sketch and/or --spiffs')
+
+    key = None
+    if args.key:
+        ecdsa = load_ecdsa()
+        with open(args.key, 'rb') as f:
+            key = ecdsa.SigningKey.from_pem(f.read())
+
+    base = None
+    if args.base:
+        with open(args.base, 'rb') as f:
+            base = f.read()
+
+    efu = build(images, key, args.compress, base)
+    with open(args.output, 'wb') as f:
+        f.write(efu)
+    print('%s: %d bytes' % (args.output, len(efu)))
+
+
+def main():
+    parser = argparse.ArgumentParser(description='ESPixelStick EFU image tool')
+    sub = parser.add_subparsers(dest='command')
+    sub.required = True
+
+    p = sub.add_parser('keygen', help='create a signing key and print the public key')
+    p.add_argument('keyfile')
+    p.set_defaults(func=cmd_keygen)
+
+    p = sub.add_parser('build', help='build an EFU image')
+    p.add_argument('-o', '--output', required=True)
+    p.add_argument('--sketch', help='sketch binary')
+    p.add_argument('--spiffs', help='SPIFFS image')
+    p.add_argument('--key', help='PEM signing key; signs each image')
+    p.add_argument('--compress', action='store_true', help='deflate each image')
+    p.add_argument('--base', help='sketch binary running on the device; sends the sketch as a patch against it')
+    p.set_defaults(func=cmd_build)
+
+    args = parser.parse_args()
+    args.func(args)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,268 @@
+#!/usr/bin/env python3
+#
+# udpcmd.py
+#
+# Project: ESPixelStick - An ESP8266 and E1.31 based pixel driver
+# Copyright (c) 2016 Shelby Merrick
+# http://www.forkineye.com
+#
+#  This program is provided free for you to use in any way that you wish,
+#  subject to the laws and regulations where you are using it.  Due diligence
+#  is strongly suggested before using this code.  Please give credit where due.
+#
+#  The Author makes no warranty of any kind, express or implied, with regard
+#  to this program or the documentation contained in this document.  The
+#  Author shall not be liable in any event for incidental or consequential
+#  damages in connection with, or arising out of, the furnishing, performance
+#  or use of these programs.
+#
+# Sends authenticated relay commands over UDP, and benchmarks them against
+# the HTTP handlers.
+#
+#   udpcmd.py keygen keyfile
+#   udpcmd.py send --key keyfile [--group N] (host | --multicast) on|off|blink|pulse [--arg ms]
+#   udpcmd.py bench --key keyfile host [--count N] [--rate R] [--senders S]
+#
+# Packet layout (little endian, see CommandChannel::packet_t):
+#   'R' 'C', uint8 version, uint8 command, uint16 sender, uint8 group,
+#   uint8 flags, uint32 seq, uint32 time (epoch s), uint32 arg,
+#   12 bytes of HMAC-SHA256 over everything ahead of it.
+# The device acks a valid packet with the same fields, the command replaced
+# by a status, signed with the same key.
+
+import argparse
+import hashlib
+import hmac
+import os
+import random
+import socket
+import statistics
+import struct
+import sys
+import time
+import urllib.request
+
+MAGIC = b'RC'
+VERSION = 1
+HEADER = struct.Struct('<2sBBHBBIII')
+MAC_LEN = 12
+PACKET_LEN = HEADER.size + MAC_LEN
+
+PORT = 5570
+MULTICAST = '239.255.82.67'
+
+# RelayAction in ESPixelStick.ino
+COMMANDS = {'on': 0, 'off': 1, 'blink': 2, 'pulse': 3}
+
+# CommandChannel::Status
+STATUS = {0x80: 'ok', 0x81: 'replay', 0x82: 'stale', 0x83: 'unknown',
+          0x84: 'unsynced'}
+
+
+class Sender:
+    def __init__(self, key, sender=None):
+        self.key = key
+        self.sender = random.getrandbits(16) if sender is None else sender
+        self.seq = 0
+
+    def mac(self, header):
+        return hmac.new(self.key, header, hashlib.sha256).digest()[:MAC_LEN]
+
+    def packet(self, command, arg=0, group=0):
+        self.seq += 1
+        header = HEADER.pack(MAGIC, VERSION, command, self.sender, group, 0,
+                             self.seq, int(time.time()), arg)
+        return self.seq, header + self.mac(header)
+
+    def ack(self, data):
+        """Returns (seq, status) of a valid ack, or None"""
+        if len(data) != PACKET_LEN:
+            return None
+        header, mac = data[:HEADER.size], data[HEADER.size:]
+        if not hmac.compare_digest(mac, self.mac(header)):
+            return None
+        magic, version, status, sender, _, _, seq, _, _ = HEADER.unpack(header)
+        if magic != MAGIC or version != VERSION or sender != self.sender:
+            return None
+        return seq, STATUS.get(status, hex(status))
+
+
+def load_key(path):
+    with open(path, 'rb') as f:
+        return bytes.fromhex(f.read().decode().strip())
+
+
+def percentile(values, p):
+    values = sorted(values)
+    return values[min(len(values) - 1, int(len(values) * p / 100))]
+
+
+def summary(name, times, sent):
+    if not times:
+        print('%-5s no replies out of %d' % (name, sent))
+        return
+    ms = [t * 1000 for t in times]
+    print('%-5s %5d/%-5d min %7.2f  median %7.2f  p99 %7.2f  max %7.2f ms' %
+          (name, len(ms), sent, min(ms), statistics.median(ms),
+           percentile(ms, 99), max(ms)))
+
+
+def heap(host):
+    try:
+        with urllib.request.urlopen('http://%s/heap' % host, timeout=2) as r:
+            return int(r.read())
+    except (OSError, ValueError):
+        return None
+
+
+def cmd_keygen(args):
+    key = os.urandom(32)
+    with open(args.keyfile, 'w') as f:
+        f.write(key.hex() + '\n')
+    print('#define UDP_CMD_KEY { ' + ', '.join('0x%02x' % b for b in key) + ' }')
+
+
+def cmd_send(args):
+    if not args.host and not args.multicast:
+        sys.exit('give a host or --multicast')
+    sender = Sender(load_key(args.key))
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_TTL, 1)
+    sock.settimeout(args.timeout)
+
+    seq, packet = sender.packet(COMMANDS[args.action], args.arg, args.group)
+    sock.sendto(packet, (args.host or MULTICAST, PORT))
+
+    # Every device in the group acks a multicast command
+    try:
+        while True:
+            data, addr = sock.recvfrom(64)
+            ack = sender.ack(data)
+            if ack and ack[0] == seq:
+                print('%s: %s' % (addr[0], ack[1]))
+                if args.host:
+                    break
+    except socket.timeout:
+        pass
+
+
+def bench_udp(sender, host, count, rate):
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.setblocking(False)
+    sent = {}       # seq: send time, until acked
+    count_sent = 0
+    times = []
+    statuses = {}
+    interval = 1.0 / rate
+    next_send = time.monotonic()
+    deadline = None
+
+    while True:
+        now = time.monotonic()
+        if count_sent < count and now >= next_send:
+            # Alternate so the relay actually switches
+            seq, packet = sender.packet(COMMANDS['on' if count_sent % 2 else 'off'])
+            sent[seq] = now
+            sock.sendto(packet, (host, PORT))
+            count_sent += 1
+            next_send += interval
+            if count_sent == count:
+                deadline = now + 1.0
+        try:
+            while True:
+                data, _ = sock.recvfrom(64)
+                ack = sender.ack(data)
+                if ack and ack[0] in sent:
+                    times.append(time.monotonic() - sent.pop(ack[0]))
+                    statuses[ack[1]] = statuses.get(ack[1], 0) + 1
+        except BlockingIOError:
+            pass
+        if deadline and (time.monotonic() > deadline or not sent):
+            break
+        time.sleep(min(0.0005, max(0, next_send - time.monotonic())))
+
+    return times, statuses
+
+
+def bench_http(host, count, rate):
+    times = []
+    interval = 1.0 / rate
+    next_send = time.monotonic()
+    for i in range(count):
+        time.sleep(max(0, next_send - time.monotonic()))
+        next_send += interval
+        start = time.monotonic()
+        try:
+            url = 'http://%s/%s' % (host, 'on' if i % 2 else 'off')
+            with urllib.request.urlopen(url, timeout=2) as r:
+                r.read()
+            times.append(time.monotonic() - start)
+        except OSError:
+            pass
+    return times
+
+
+def cmd_bench(args):
+    key = load_key(args.key)
+    senders = [Sender(key) for _ in range(args.senders)]
+
+    print('%d commands at %g/s to %s, %d UDP sender(s)' %
+          (args.count, args.rate, args.host, args.senders))
+    before = heap(args.host)
+
+    udp_times = []
+    udp_status = {}
+    for sender in senders:
+        times, statuses = bench_udp(sender, args.host, args.count // len(senders),
+                                    args.rate)
+        udp_times += times
+        for status, n in statuses.items():
+            udp_status[status] = udp_status.get(status, 0) + n
+    udp_heap = heap(args.host)
+
+    http_times = bench_http(args.host, args.count, args.rate)
+    http_heap = heap(args.host)
+
+    summary('udp', udp_times, args.count)
+    if udp_status:
+        print('      acks: ' + ', '.join('%s %d' % s for s in sorted(udp_status.items())))
+    summary('http', http_times, args.count)
+    if before is not None:
+        print('free heap: %d before, %s after UDP, %s after HTTP' %
+              (before, udp_heap, http_heap))
+    print('see /metrics for device side timings')
+
+
+def main():
+    parser = argparse.ArgumentParser(description='ESPixelStick UDP command tool')
+    sub = parser.add_subparsers(dest='command')
+    sub.required = True
+
+    p = sub.add_parser('keygen', help='create a key and print it for UDP_CMD_KEY')
+    p.add_argument('keyfile')
+    p.set_defaults(func=cmd_keygen)
+
+    p = sub.add_parser('send', help='send one command')
+    p.add_argument('--key', required=True, help='key file from keygen')
+    p.add_argument('--group', type=int, default=0, help='command group, 0 for all')
+    p.add_argument('--multicast', action='store_true', help='send to the multicast group')
+    p.add_argument('--arg', type=int, default=0, help='pulse length in ms')
+    p.add_argument('--timeout', type=float, default=1.0, help='seconds to wait for acks')
+    p.add_argument('host', nargs='?')
+    p.add_argument('action', choices=sorted(COMMANDS))
+    p.set_defaults(func=cmd_send)
+
+    p = sub.add_parser('bench', help='compare UDP and HTTP command latency')
+    p.add_argument('--key', required=True, help='key file from keygen')
+    p.add_argument('--count', type=int, default=200, help='commands per path')
+    p.add_argument('--rate', type=float, default=20, help='commands per second')
+    p.add_argument('--senders', type=int, default=1, help='UDP sender ids to spread over')
+    p.add_argument('host')
+    p.set_defaults(func=cmd_bench)
+
+    args = parser.parse_args()
+    args.func(args)
+
+
+if __name__ == '__main__':
+    main()